@@ -0,0 +1,213 @@
+#include "admission_control.h"
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+
+// Начальный размер таблицы адресов
+constexpr size_t initial_capacity = 256;
+
+// Перемешивает биты ключа, чтобы соседние адреса попадали в разные ячейки
+uint64_t mix(uint64_t key)
+{
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return key;
+}
+
+}
+
+bool token_bucket::consume(float rate, float burst, uint32_t now_ms)
+{
+  if (stamp == 0)
+  {
+    tokens = burst;
+  }
+  else
+  {
+    // Беззнаковая разность корректна и при переполнении счётчика
+    uint32_t elapsed = now_ms - stamp;
+    tokens = std::min(burst, tokens + elapsed * rate / 1000.0f);
+  }
+  stamp = now_ms;
+
+  if (tokens < 1.0f)
+    return false;
+  tokens -= 1.0f;
+  return true;
+}
+
+admission_control::admission_control(admission_limits limits) :
+  limits(limits),
+  started(std::chrono::steady_clock::now()),
+  table(initial_capacity, entry{0, 0, {}}),
+  used(0)
+{}
+
+uint64_t admission_control::address_key(const net_address & addr)
+{
+  switch (addr.family())
+  {
+  case AF_INET:
+  {
+    // Старшие биты выставлены, чтобы ключ IPv4 не совпал с реальным префиксом IPv6
+    const auto * in = reinterpret_cast<const sockaddr_in *>(addr.data());
+    return 0xFFFFFFFF00000000ULL | ntohl(in->sin_addr.s_addr);
+  }
+  case AF_INET6:
+  {
+    const auto * in6 = reinterpret_cast<const sockaddr_in6 *>(addr.data());
+    const uint8_t * bytes = in6->sin6_addr.s6_addr;
+    // Клиенты IPv4 на слушателе [::] приходят с адресами ::ffff:a.b.c.d,
+    //  их ограничиваем так же, как если бы они пришли по IPv4
+    static constexpr uint8_t v4_mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+    if (::memcmp(bytes, v4_mapped, sizeof(v4_mapped)) == 0)
+    {
+      uint64_t ip = 0;
+      for (int i = 12; i < 16; ++i)
+        ip = (ip << 8) | bytes[i];
+      return 0xFFFFFFFF00000000ULL | ip;
+    }
+    uint64_t prefix = 0;
+    for (int i = 0; i < 8; ++i)
+      prefix = (prefix << 8) | bytes[i];
+    // Ноль - метка пустой записи, а в подсети ::/64 лежит ::1, поэтому ей отдаём ключ 1
+    // Реальных адресов с префиксом 0:0:0:1::/64 не бывает
+    return prefix == 0 ? 1 : prefix;
+  }
+  default:
+    return 0;
+  }
+}
+
+bool admission_control::try_admit(uint64_t key)
+{
+  if (stats.connections >= limits.max_connections)
+  {
+    ++stats.rejected_connections;
+    return false;
+  }
+
+  if (key != 0)
+  {
+    entry * e = find_or_insert(key);
+    if (e->connections >= limits.max_connections_per_address)
+    {
+      ++stats.rejected_connections;
+      return false;
+    }
+    ++e->connections;
+  }
+
+  ++stats.connections;
+  return true;
+}
+
+void admission_control::release(uint64_t key)
+{
+  if (stats.connections > 0)
+    --stats.connections;
+
+  if (key == 0)
+    return;
+  entry * e = find(key);
+  if (e != nullptr && e->connections > 0)
+    --e->connections;
+}
+
+bool admission_control::allow_command(uint64_t key, token_bucket & connection_bucket)
+{
+  uint32_t now = now_ms();
+  if (connection_bucket.consume(limits.connection_rate, limits.connection_burst, now) == false)
+  {
+    ++stats.rejected_commands;
+    return false;
+  }
+
+  if (key == 0)
+    return true;
+  entry * e = find_or_insert(key);
+  if (e->bucket.consume(limits.address_rate, limits.address_burst, now) == false)
+  {
+    ++stats.rejected_commands;
+    return false;
+  }
+  return true;
+}
+
+uint32_t admission_control::now_ms() const
+{
+  auto elapsed = std::chrono::steady_clock::now() - started;
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count();
+  // Ноль зарезервирован для неиспользованного ведра
+  return static_cast<uint32_t>(ms) | 1;
+}
+
+admission_control::entry * admission_control::find(uint64_t key)
+{
+  size_t mask = table.size() - 1;
+  for (size_t i = mix(key) & mask; ; i = (i + 1) & mask)
+  {
+    if (table[i].key == key)
+      return &table[i];
+    if (table[i].key == 0)
+      return nullptr;
+  }
+}
+
+admission_control::entry * admission_control::find_or_insert(uint64_t key)
+{
+  entry * e = find(key);
+  if (e != nullptr)
+    return e;
+
+  // Держим заполненность не выше половины
+  // Сначала выкидываем адреса без соединений, и только если это не помогло - растём
+  if ((used + 1) * 2 > table.size())
+  {
+    rebuild(table.size(), true);
+    if ((used + 1) * 2 > table.size())
+      rebuild(table.size() * 2, false);
+  }
+
+  size_t mask = table.size() - 1;
+  size_t i = mix(key) & mask;
+  while (table[i].key != 0)
+    i = (i + 1) & mask;
+  table[i] = entry{key, 0, {}};
+  ++used;
+  return &table[i];
+}
+
+void admission_control::rebuild(size_t capacity, bool drop_idle)
+{
+  std::vector<entry> old(capacity, entry{0, 0, {}});
+  old.swap(table);
+  used = 0;
+
+  uint32_t now = now_ms();
+  size_t mask = table.size() - 1;
+  for (const entry & e : old)
+  {
+    if (e.key == 0)
+      continue;
+    // Адрес без соединений, ведро которого уже успело наполниться, ничем не отличается от нового
+    if (drop_idle && e.connections == 0)
+    {
+      token_bucket bucket = e.bucket;
+      float full = limits.address_burst;
+      if (bucket.consume(limits.address_rate, full, now) && bucket.tokens + 1.0f >= full)
+        continue;
+    }
+
+    size_t i = mix(e.key) & mask;
+    while (table[i].key != 0)
+      i = (i + 1) & mask;
+    table[i] = e;
+    ++used;
+  }
+}
@@ -0,0 +1,97 @@
+#ifndef ADMISSION_CONTROL_H
+#define ADMISSION_CONTROL_H
+
+#include "net_address.h"
+#include <chrono>
+#include <vector>
+
+// В файле представлена подсистема ограничения нагрузки:
+//  - общее ограничение на количество соединений,
+//  - ограничение на количество соединений с одного адреса,
+//  - ограничение частоты команд для соединения и для адреса(алгоритм token bucket)
+// Отказы ничего не аллоцируют и не пишут в лог, только увеличивают счётчики
+
+// Дескрипторы, оставляемые под слушающие сокеты, UDP-сервисы, таймеры и файлы
+constexpr size_t reserved_descriptors = 64;
+// Больше соединений select обслужить не сможет
+constexpr size_t max_select_connections = FD_SETSIZE - reserved_descriptors;
+
+// Ограничения, по умолчанию подобраны так, чтобы select не вышел за FD_SETSIZE
+struct admission_limits
+{
+  size_t max_connections = max_select_connections;
+  uint32_t max_connections_per_address = 32;
+  // Команд в секунду и максимальная пачка для одного соединения
+  float connection_rate = 20;
+  float connection_burst = 40;
+  // Команд в секунду и максимальная пачка для всех соединений с одного адреса
+  float address_rate = 100;
+  float address_burst = 200;
+};
+
+// Ведро токенов, занимает 8 байт, поэтому его можно хранить в каждом соединении
+// Время хранится в миллисекундах от создания admission_control, ноль означает "ещё не использовалось"
+struct token_bucket
+{
+  float tokens = 0;
+  uint32_t stamp = 0;
+
+  // Пополняет ведро с учётом прошедшего времени и пытается забрать один токен
+  bool consume(float rate, float burst, uint32_t now_ms);
+};
+
+class admission_control
+{
+public:
+  explicit admission_control(admission_limits limits = {});
+
+  // Ключ адреса для таблицы, для IPv6 используется префикс /64,
+  //  т.к. обычно вся подсеть /64 принадлежит одному клиенту
+  // Адреса IPv4, отображённые в IPv6(::ffff:a.b.c.d), получают тот же ключ, что и IPv4
+  // Для Unix-сокетов возвращает 0 - такие клиенты не ограничиваются по адресу,
+  //  для IP-адресов 0 не возвращается никогда
+  static uint64_t address_key(const net_address & addr);
+
+  // Вызывается при приёме соединения, false означает, что соединение нужно закрыть
+  bool try_admit(uint64_t key);
+  // Вызывается при закрытии соединения, которое было принято
+  void release(uint64_t key);
+  // Вызывается перед обработкой каждой команды
+  bool allow_command(uint64_t key, token_bucket & connection_bucket);
+
+  const admission_limits & get_limits() const { return limits; }
+  void set_limits(const admission_limits & new_limits) { limits = new_limits; }
+
+  struct counters
+  {
+    uint64_t connections = 0;
+    uint64_t rejected_connections = 0;
+    uint64_t rejected_commands = 0;
+  };
+  const counters & get_counters() const { return stats; }
+  size_t tracked_addresses() const { return used; }
+
+private:
+  // Запись таблицы адресов, 24 байта
+  struct entry
+  {
+    uint64_t key;
+    uint32_t connections;
+    token_bucket bucket;
+  };
+
+  admission_limits limits;
+  counters stats;
+  std::chrono::steady_clock::time_point started;
+  // Таблица с открытой адресацией и линейным пробированием, размер - степень двойки
+  // Пустая запись имеет ключ 0
+  std::vector<entry> table;
+  size_t used;
+
+  uint32_t now_ms() const;
+  entry * find(uint64_t key);
+  entry * find_or_insert(uint64_t key);
+  void rebuild(size_t capacity, bool drop_idle);
+};
+
+#endif // ADMISSION_CONTROL_H
@@ -2,19 +2,44 @@
 #include <cstdlib>
 #include <ctime>
 #include <iostream>
+#include "logger.h"
 #ifdef WIN32
 #include <windows.h>
 #endif
 #include "command_encoder.h"
 
 application::application() :
-  conn_manager(*this)
+  conn_manager(*this),
+  active_handlers(0),
+  handlers_memory(0),
+  limits_enabled(true),
+  ticks(0),
+  idle_ticks(5),
+  reload_requested(false),
+  trace_dump_requested(false),
+  next_generation(0),
+  offloaded_tasks(0),
+  use_coroutines(false),
+  coroutines(*this)
 {
+  conn_manager.set_admission_control(&admission);
   std::srand(std::time(nullptr));
 }
 
-int application::run(const std::string & ip, uint32_t port)
+int application::run(const server_config & cfg, const std::string & path,
+                     const config_overrides & overrides)
 {
+  config = cfg;
+  config_path = path;
+  cli_overrides = overrides;
+  if (config.has_seed)
+    set_seed(config.seed);
+  if (config.capture_path.empty() == false && start_capture(config.capture_path) == false)
+    return EXIT_FAILURE;
+  set_limits_enabled(config.limits_enabled);
+  set_coroutine_sessions(config.coroutine_sessions);
+  apply_live_config(config);
+
 #ifdef WIN32
   WSADATA wsa_data;
   if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
@@ -25,44 +50,274 @@ int application::run(const std::string & ip, uint32_t port)
 #endif
 
   int ret = EXIT_SUCCESS;
-  if (conn_manager.start(ip, port) == false)
+  // UDP-сервисы открываются заранее и обслуживаются в цикле менеджера подключений
+  for (const auto & address : config.udp)
+  {
+    auto service = std::make_unique<udp_service>();
+    if (service->open(address) == false)
+    {
+      ret = EXIT_FAILURE;
+      break;
+    }
+    conn_manager.watch_socket(service->socket(), *service);
+    udp_services.push_back(std::move(service));
+  }
+
+  if (ret == EXIT_SUCCESS && config.worker_threads != 0)
+  {
+    if (completions.open(conn_manager))
+      executor = std::make_unique<task_executor>(config.worker_threads);
+    else
+      ret = EXIT_FAILURE;
+  }
+
+  if (ret == EXIT_SUCCESS && use_coroutines && coroutines.open_timers(conn_manager) == false)
+    ret = EXIT_FAILURE;
+
+  // Сертификат проверяем до запуска, чтобы не начать принимать соединения, которые не сможем обслужить
+  if (ret == EXIT_SUCCESS && config.tls_listen.empty() == false)
+  {
+    if (config.tls_cert.empty() || config.tls_key.empty())
+    {
+      std::cerr << "tls_listen requires tls_cert and tls_key" << std::endl;
+      ret = EXIT_FAILURE;
+    }
+    else if ((tls = tls_context::create(config.tls_cert, config.tls_key)) == nullptr)
+      ret = EXIT_FAILURE;
+    else
+      conn_manager.set_tls_context(tls.get());
+  }
+
+  if (ret == EXIT_SUCCESS && conn_manager.start(config.listen, config.tls_listen) == false)
   {
     std::cerr << "Cannot start manager" << std::endl;
     ret = EXIT_FAILURE;
   }
 
+  if (tracer.enabled())
+    dump_trace();
+
+  // Сначала останавливаем пул, чтобы никто больше не писал в очередь завершений
+  executor.reset();
+  completions.close();
+  coroutines.close_timers();
+
+  for (auto & service : udp_services)
+  {
+    conn_manager.unwatch_socket(service->socket());
+    service->close();
+  }
+  udp_services.clear();
+
 #ifdef WIN32
   WSACleanup();
 #endif
   return ret;
 }
 
+void application::request_reload()
+{
+  reload_requested = true;
+}
+
+void application::request_trace_dump()
+{
+  trace_dump_requested = true;
+}
+
+void application::dump_trace()
+{
+  if (tracer.dump(config.trace_file) && log_enabled(log_level::info))
+    std::cout << "trace: " << tracer.record_count() << " requests written to: " << config.trace_file
+              << ", dropped: " << tracer.dropped_count() << std::endl;
+}
+
+void application::apply_live_config(const server_config & cfg)
+{
+  current_log_level = cfg.level;
+  conn_manager.set_loop_options(cfg.loop);
+  admission.set_limits(cfg.limits);
+  command_decoder::set_max_command_length(cfg.max_command_length);
+  idle_ticks = cfg.idle_session_sec;
+  tracer.configure(cfg.trace_sample, cfg.trace_buffer);
+  coroutines.set_handshake_timeout(std::chrono::milliseconds(cfg.handshake_timeout_ms));
+}
+
+void application::reload_config()
+{
+  if (config_path.empty())
+  {
+    std::cerr << "no config file to reload" << std::endl;
+    return;
+  }
+
+  // Собираем конфигурацию заново, чтобы удалённые из файла ключи вернулись к значениям по умолчанию
+  // Параметры командной строки по-прежнему важнее файла
+  // При ошибке в файле ничего не применяем
+  server_config updated;
+  if (build_config(config_path, cli_overrides, updated) == false)
+  {
+    std::cerr << "config reload failed, keeping current settings" << std::endl;
+    return;
+  }
+
+  for (const auto & name : restart_required_changes(config, updated))
+    std::cerr << "config option '" << name << "' changed, restart is required to apply it" << std::endl;
+
+  // Параметры, требующие перезапуска, оставляем прежними
+  updated.listen = config.listen;
+  updated.tls_listen = config.tls_listen;
+  updated.tls_cert = config.tls_cert;
+  updated.tls_key = config.tls_key;
+  updated.udp = config.udp;
+  updated.limits_enabled = config.limits_enabled;
+  updated.has_seed = config.has_seed;
+  updated.seed = config.seed;
+  updated.capture_path = config.capture_path;
+  updated.loop.listen_backlog = config.loop.listen_backlog;
+  updated.worker_threads = config.worker_threads;
+  updated.coroutine_sessions = config.coroutine_sessions;
+
+  config = updated;
+  apply_live_config(config);
+  if (log_enabled(log_level::info))
+    std::cout << "config reloaded from: " << config_path << std::endl;
+}
+
+void application::set_seed(unsigned seed)
+{
+  std::srand(seed);
+}
+
+void application::set_limits_enabled(bool enabled)
+{
+  limits_enabled = enabled;
+  conn_manager.set_admission_control(enabled ? &admission : nullptr);
+  coroutines.set_admission_control(enabled ? &admission : nullptr);
+}
+
+void application::set_coroutine_sessions(bool enabled)
+{
+  use_coroutines = enabled;
+}
+
+bool application::start_capture(const std::string & path)
+{
+  return capture.open(path);
+}
+
 void application::on_connection(connection_id id)
 {
   // Добавляем в карту новое соединение
-  std::cout << "on connection: " << id << std::endl;
-  conns.emplace(id, std::make_unique<client_handler>(id, *this));
+  // Обработчик не создаём: многие клиенты долго ничего не присылают
+  if (log_enabled(log_level::debug))
+    std::cout << "on connection: " << id << std::endl;
+  capture.write_open(id);
+  uint64_t address_key = admission_control::address_key(conn_manager.get_peer_address(id));
+  if (use_coroutines)
+  {
+    coroutines.open(id, address_key);
+    return;
+  }
+  session sess;
+  sess.state.address_key = address_key;
+  sess.last_active = ticks;
+  sess.generation = ++next_generation;
+  // Сессия с тем же идентификатором означает, что о закрытии прошлого соединения мы не узнали
+  // Наследовать её нельзя: новый клиент получил бы чужой hello, ведро токенов и адрес
+  auto [it, inserted] = conns.try_emplace(id);
+  if (inserted == false)
+  {
+    std::cerr << "replacing stale session for id: " << id << std::endl;
+    release_handler(it->second);
+  }
+  it->second = std::move(sess);
 }
 
 void application::on_connection_closed(connection_id id)
 {
   // Просто удаляем, тут нет каких-то ресурсов, которые нужно дополнительно освобождать
-  std::cout << "on connection closed: " << id << std::endl;
-  conns.erase(id);
+  if (log_enabled(log_level::debug))
+    std::cout << "on connection closed: " << id << std::endl;
+  capture.write_close(id);
+  if (use_coroutines)
+  {
+    coroutines.close(id);
+    return;
+  }
+  auto it = conns.find(id);
+  if (it == conns.end())
+    return;
+  release_handler(it->second);
+  conns.erase(it);
 }
 
 void application::on_connection_read(connection_id id, buffer_type buf)
 {
   // Проверяем, есть ли такое соединение, и посылаем буфер обработчику
-  std::cout << "on connection read: " << id << ", size: " << buf.size() << std::endl;
+  if (log_enabled(log_level::debug))
+    std::cout << "on connection read: " << id << ", size: " << buf.size() << std::endl;
+  capture.write_data(id, buf);
+  if (use_coroutines)
+  {
+    coroutines.data_received(id, std::move(buf));
+    return;
+  }
   auto it = conns.find(id);
   if (it == conns.end())
   {
     std::cerr << "cannot find id: " << id << std::endl;
     return;
   }
-  client_handler_ptr & handler = it->second;
-  handler->data_received(std::move(buf));
+  session & sess = it->second;
+  size_t old_memory = 0;
+  if (sess.handler == nullptr)
+  {
+    sess.handler = std::make_unique<client_handler>(id, *this, limits_enabled ? &admission : nullptr,
+                                                    sess.state);
+    ++active_handlers;
+  }
+  else
+    old_memory = sess.handler->memory_usage();
+  sess.last_active = ticks;
+  sess.handler->data_received(std::move(buf));
+  // Из обработчиков память меняет только буфер декодера, а он меняется только здесь
+  handlers_memory += sess.handler->memory_usage();
+  handlers_memory -= old_memory;
+}
+
+void application::on_tick()
+{
+  ++ticks;
+  if (reload_requested.exchange(false))
+    reload_config();
+  if (trace_dump_requested.exchange(false))
+    dump_trace();
+  // На системах, где очередь завершений не умеет будить select, результаты забираются здесь
+  completions.drain();
+  coroutines.on_tick();
+
+  // Сжимаем сессии, которые давно ничего не присылали и не ждут продолжения команды
+  for (auto & [id, sess] : conns)
+  {
+    if (sess.handler != nullptr && ticks - sess.last_active >= idle_ticks && sess.handler->is_idle())
+      release_handler(sess);
+  }
+}
+
+size_t application::memory_usage() const
+{
+  return conn_manager.memory_usage() + hash_map_memory(conns) + handlers_memory + coroutines.memory_usage();
+}
+
+void application::release_handler(session & sess)
+{
+  if (sess.handler == nullptr)
+    return;
+  --active_handlers;
+  handlers_memory -= sess.handler->memory_usage();
+  sess.state = sess.handler->state;
+  sess.handler.reset();
 }
 
 void application::on_send_command(connection_id id, command cmd)
@@ -72,6 +327,87 @@ void application::on_send_command(connection_id id, command cmd)
   buffer_type buf;
   if (command_encoder::encode(cmd, buf) == false)
     return;
-  std::cout << "write for id: " << id << ": " << buf.size() << " bytes for: " << cmd.type << std::endl;
+  tracer.on_encoded(id);
+  if (log_enabled(log_level::debug))
+    std::cout << "write for id: " << id << ": " << buf.size() << " bytes for: " << cmd.type << std::endl;
   conn_manager.write_to_connection(id, std::move(buf));
 }
+
+void application::offload(connection_id id, uint32_t seq, std::function<command()> task)
+{
+  auto it = conns.find(id);
+  if (it == conns.end())
+    return;
+  uint64_t generation = it->second.generation;
+  run_task(std::move(task), [this, id, generation, seq](command result)
+  {
+    complete_task(id, generation, seq, std::move(result));
+  });
+}
+
+void application::run_task(std::function<command()> task, std::function<void(command)> done)
+{
+  ++offloaded_tasks;
+  if (executor == nullptr)
+  {
+    done(task());
+    return;
+  }
+
+  executor->submit([this, task = std::move(task), done = std::move(done)]
+  {
+    command result = task();
+    completions.post([done, result = std::move(result)]() mutable
+    {
+      done(std::move(result));
+    });
+  });
+}
+
+void application::close_connection(connection_id id)
+{
+  conn_manager.close_connection(id);
+}
+
+void application::complete_task(connection_id id, uint64_t generation, uint32_t seq, command result)
+{
+  // Пока у обработчика есть неотправленные ответы, сессия не сжимается, так что обработчик на месте
+  auto it = conns.find(id);
+  if (it == conns.end() || it->second.generation != generation || it->second.handler == nullptr)
+    return;
+  it->second.handler->on_task_done(seq, std::move(result));
+}
+
+void application::fill_stats(command::arguments_type & args)
+{
+  const auto & counters = admission.get_counters();
+  size_t active = coroutines.size() + active_handlers;
+  size_t memory = memory_usage();
+  size_t connections = conns.size() + coroutines.size();
+  args.emplace("connections", std::to_string(connections));
+  args.emplace("active_sessions", std::to_string(active));
+  args.emplace("memory_bytes", std::to_string(memory));
+  args.emplace("bytes_per_connection", std::to_string(connections == 0 ? 0 : memory / connections));
+  args.emplace("tracked_addresses", std::to_string(admission.tracked_addresses()));
+  args.emplace("rejected_connections", std::to_string(counters.rejected_connections));
+  args.emplace("rejected_commands", std::to_string(counters.rejected_commands));
+  args.emplace("worker_threads", std::to_string(executor == nullptr ? 0 : executor->thread_count()));
+  args.emplace("offloaded_tasks", std::to_string(offloaded_tasks));
+  args.emplace("stolen_tasks", std::to_string(executor == nullptr ? 0 : executor->stolen_count()));
+
+  udp_service::counters udp;
+  for (const auto & service : udp_services)
+  {
+    const auto & c = service->get_counters();
+    udp.received += c.received;
+    udp.sent += c.sent;
+    udp.dropped += c.dropped;
+    udp.bad_token += c.bad_token;
+    udp.too_short += c.too_short;
+  }
+  args.emplace("udp_received", std::to_string(udp.received));
+  args.emplace("udp_sent", std::to_string(udp.sent));
+  args.emplace("udp_dropped", std::to_string(udp.dropped));
+  args.emplace("udp_bad_token", std::to_string(udp.bad_token));
+  args.emplace("udp_too_short", std::to_string(udp.too_short));
+}
@@ -3,33 +3,127 @@
 
 #include "connection_manager.h"
 #include "client_handler.h"
+#include "udp_service.h"
+#include "traffic_capture.h"
+#include "server_config.h"
+#include "task_executor.h"
+#include "completion_queue.h"
+#include "coroutine_session.h"
+#include "tls_transport.h"
+#include <atomic>
+#include <memory>
 #include <unordered_map>
 
 // Класс, с которого начинается жизнь сервера
 // Содержит в себе менеджер подключений(другими словами TCP-сервер),
-//  а также карту с идентификатора подключения на его обработчик
+//  а также карту с идентификатора подключения на его сессию
+// Обработчик у сессии есть, только пока клиент активен: простаивающие сессии сжимаются
+//  до client_state, а обработчик создаётся заново, когда клиент что-то пришлёт
+// Также может содержать UDP-сервисы, работающие в цикле менеджера подключений
+// Тяжёлые команды обработчиков выполняются в пуле потоков, а результаты возвращаются
+//  в цикл менеджера через очередь завершений
 // Он сам является посредником между менеджером подключений и обработчиками
 // Это необходимо, чтобы избежать высокой связанности обработчика и сервера,
 //  они не должны друг об друге знать
+// Вместо обработчиков сессии могут обслуживаться сопрограммами(session_api = coroutine)
 class application : public connection_manager_user,
-                    public client_handler_owner
+                    public client_handler_owner,
+                    public coro_host_owner
 {
 public:
   application();
 
-  int run(const std::string & ip, uint32_t port);
+  // Запускает сервер с переданной конфигурацией
+  // path и overrides - откуда она была собрана, по request_reload она собирается заново
+  int run(const server_config & cfg, const std::string & path = {},
+          const config_overrides & overrides = {});
+
+  // Просит перечитать файл конфигурации, можно вызывать из обработчика сигнала
+  // Файл перечитывается в цикле сервера на ближайшем тике
+  void request_reload();
+  // Просит выгрузить трассировку запросов в trace_file, можно вызывать из обработчика сигнала
+  void request_trace_dump();
+  // Применяет параметры, которые можно менять без перезапуска
+  void apply_live_config(const server_config & cfg);
+
+  // Фиксирует зерно генератора случайных чисел, чтобы результаты бросков были воспроизводимыми
+  void set_seed(unsigned seed);
+  // Включает и выключает ограничения нагрузки, например, для замеров производительности
+  // Должна вызываться до run
+  void set_limits_enabled(bool enabled);
+  // Обслуживать сессии сопрограммами вместо client_handler, должна вызываться до run
+  void set_coroutine_sessions(bool enabled);
+  // Начинает записывать весь входящий трафик в файл захвата
+  [[nodiscard]]
+  bool start_capture(const std::string & path);
 
   // connection_manager_user interface
   void on_connection(connection_id id) override;
   void on_connection_closed(connection_id id) override;
   void on_connection_read(connection_id id, buffer_type buf) override;
+  void on_tick() override;
 
   // client_handler_owner interface
   void on_send_command(connection_id id, command cmd) override;
+  void fill_stats(command::arguments_type & args) override;
+  void offload(connection_id id, uint32_t seq, std::function<command()> task) override;
+  // Также часть coro_host_owner
+  void close_connection(connection_id id) override;
+
+  // coro_host_owner interface
+  void run_task(std::function<command()> task, std::function<void(command)> done) override;
+
+  // Сессия клиента
+  struct session
+  {
+    client_state state;
+    // nullptr, если сессия сжата
+    client_handler_ptr handler;
+    // Номер тика, на котором сессия последний раз получала данные
+    uint32_t last_active = 0;
+    // Номер сессии, по нему отбрасываются результаты задач для уже закрытого соединения,
+    //  чей идентификатор успел достаться новому
+    uint64_t generation = 0;
+  };
+
+  // Оценка памяти на все соединения, включая менеджер подключений
+  size_t memory_usage() const;
+  void reload_config();
+  void dump_trace();
+  // Передаёт обработчику результат задачи, если сессия ещё жива
+  void complete_task(connection_id id, uint64_t generation, uint32_t seq, command result);
+  // Уничтожает обработчик сессии, оставляя только её client_state
+  void release_handler(session & sess);
 
 public:
+  admission_control admission;
+  // Контекст TLS-слушателей, объявлен раньше менеджера, чтобы пережить его сессии
+  std::unique_ptr<tls_context> tls;
   connection_manager conn_manager;
-  std::unordered_map<connection_id, client_handler_ptr> conns;
+  std::unordered_map<connection_id, session> conns;
+  // Количество сессий с обработчиком и занимаемая обработчиками память
+  // Считаются при создании, уничтожении обработчика и приёме данных, чтобы stats не обходил все сессии
+  size_t active_handlers;
+  size_t handlers_memory;
+  bool limits_enabled;
+  uint32_t ticks;
+  // Через сколько тиков(секунд) без данных сессия сжимается
+  uint32_t idle_ticks;
+  server_config config;
+  std::string config_path;
+  config_overrides cli_overrides;
+  std::atomic<bool> reload_requested;
+  std::atomic<bool> trace_dump_requested;
+  std::vector<std::unique_ptr<udp_service>> udp_services;
+  capture_writer capture;
+  uint64_t next_generation;
+  uint64_t offloaded_tasks;
+  // Пул объявлен после очереди, чтобы при уничтожении потоки остановились раньше неё
+  // Если пула нет(worker_threads = 0 или сервер не запущен), задачи выполняются на месте
+  completion_queue completions;
+  std::unique_ptr<task_executor> executor;
+  bool use_coroutines;
+  coro_host coroutines;
 };
 
 #endif // APPLICATION_H
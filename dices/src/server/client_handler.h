@@ -3,6 +3,11 @@
 
 #include "common_types.h"
 #include "command_decoder.h"
+#include "dice.h"
+#include "admission_control.h"
+#include "probes.h"
+#include "request_tracer.h"
+#include <functional>
 #include <memory>
 
 // Интрефейс владельца обработчика
@@ -11,6 +16,24 @@ struct client_handler_owner
 {
   virtual ~client_handler_owner() = default;
   virtual void on_send_command(connection_id id, command cmd) = 0;
+  // Заполняет аргументы ответа на команду stats
+  virtual void fill_stats(command::arguments_type & args) = 0;
+  // Выполняет тяжёлую задачу вне потока ввода-вывода
+  // Результат нужно вернуть в потоке ввода-вывода через client_handler::on_task_done с тем же seq
+  virtual void offload(connection_id id, uint32_t seq, std::function<command()> task) = 0;
+  // Закрывает соединение клиента, обработчик уничтожается позже, в on_connection_closed
+  virtual void close_connection(connection_id id) = 0;
+};
+
+// Компактное состояние клиента, которое остаётся у простаивающего соединения
+// Всё остальное(декодер с буфером, очередь ответов) создаётся заново, когда клиент снова что-то пришлёт
+// Ведро токенов хранится здесь: иначе сжатие сессии восстанавливало бы клиенту полный запас команд
+struct client_state
+{
+  // Ключ адреса клиента в подсистеме ограничения нагрузки
+  uint64_t address_key = 0;
+  token_bucket bucket;
+  bool got_handshake = false;
 };
 
 // Обработчик сообщений от клиента
@@ -19,13 +42,39 @@ struct client_handler_owner
 // На вход принимает команды, и формирует ответы
 struct client_handler : public command_decoder_user
 {
-  client_handler(connection_id id, client_handler_owner & owner) :
+  // Серии длиннее этой моделируются в пуле потоков, короткие дешевле посчитать на месте
+  static constexpr uint32_t offload_threshold = 10000;
+  static constexpr uint32_t max_simulate_count = 10000000;
+  // Сколько серий одного клиента может одновременно считаться в пуле, следующие получают ошибку
+  static constexpr uint32_t max_offloaded = 4;
+  // Сколько ответов может ждать отправки, пока считаются более ранние серии
+  // Клиент, не читающий ответы и продолжающий слать команды, отключается
+  static constexpr uint32_t max_pending = 1024;
+
+  // admission - подсистема ограничения частоты команд, может быть nullptr
+  // state - состояние, сохранённое при сжатии простаивающей сессии
+  client_handler(connection_id id, client_handler_owner & owner,
+                 admission_control * admission = nullptr, client_state state = {}) :
     id(id),
     owner(owner),
     decoder(*this),
-    got_handshake(false)
+    admission(admission),
+    state(state)
   {}
 
+  // Обработчик можно уничтожить без потери данных, если в декодере нет недополученной команды
+  //  и не осталось команд, ответ на которые ещё не отправлен
+  bool is_idle() const
+  {
+    return decoder.empty() && next_seq == next_to_send;
+  }
+
+  // Память, занимаемая обработчиком, вместе с буфером декодера
+  size_t memory_usage() const
+  {
+    return heap_block_size(sizeof(*this)) + decoder.memory_usage();
+  }
+
   // Метод обрабатывает входящий буфер, передавая его в декодер команд
   void data_received(buffer_type buf)
   {
@@ -36,48 +85,163 @@ struct client_handler : public command_decoder_user
   // Метод вызывается декодером, когда он успешно декодирует команду
   // Т.к. класс имеет состояние, то оно здесь проверяется
   // Таким образом, нельзя послать команду, если не было команды hello
-  // На данный момент поддерживается только команда roll,
-  //  которая генерирует случайное число от 1 до 6
+  // На данный момент поддерживается команда roll,
+  //  которая генерирует случайное число от 1 до 6, команда stats со статистикой сервера
+  //  и команда simulate, моделирующая серию бросков
   // На любое незнакомое сообщение отвечает ошибкой
-  // Больше на данный момент команд не поддерживается
+  // Если клиент превысил частоту команд, то команда не выполняется и он получает ошибку
+  // Каждая команда получает порядковый номер, и ответы уходят строго в порядке команд,
+  //  даже если ответ на более позднюю команду готов раньше, чем на отданную в пул потоков
   void on_decoded_command(command cmd) override
   {
+    if (check_pending() == false)
+      return;
+    uint32_t seq = next_seq++;
     command to_send;
-    if (cmd.type == "hello")
+    if (admission != nullptr && admission->allow_command(state.address_key, state.bucket) == false)
+    {
+      to_send.type = "error";
+    }
+    else if (cmd.type == "hello")
     {
       to_send.type = "ok";
-      got_handshake = true;
+      state.got_handshake = true;
     }
-    else if (!got_handshake)
+    else if (!state.got_handshake)
     {
       to_send.type = "error";
     }
     else if (cmd.type == "roll")
     {
       to_send.type = "won";
-      to_send.args.emplace("result", std::to_string(1 + rand() % 6));
+      to_send.args.emplace("result", std::to_string(roll_dice()));
+    }
+    else if (cmd.type == "stats")
+    {
+      to_send.type = "stats";
+      owner.fill_stats(to_send.args);
+    }
+    else if (cmd.type == "simulate")
+    {
+      uint32_t count = 0;
+      if (parse_count(cmd, count) == false || (count > offload_threshold && offloaded >= max_offloaded))
+      {
+        to_send.type = "error";
+      }
+      else
+      {
+        // Зерно берём из общего генератора здесь, в потоке ввода-вывода
+        uint32_t seed = static_cast<uint32_t>(std::rand());
+        if (count > offload_threshold)
+        {
+          tracer.on_offloaded();
+          ++offloaded;
+          owner.offload(id, seq, [count, seed] { return make_simulated(count, simulate_rolls(count, seed)); });
+          return;
+        }
+        to_send = make_simulated(count, simulate_rolls(count, seed));
+      }
     }
     else
     {
       to_send.type = "error";
     }
 
-    owner.on_send_command(id, std::move(to_send));
+    ROLL_PROBE2(dispatch, id, cmd.type.c_str());
+    tracer.on_dispatched(cmd.type);
+    respond(seq, std::move(to_send));
+  }
+
+  // Вызывается владельцем в потоке ввода-вывода, когда задача из offload выполнена
+  void on_task_done(uint32_t seq, command result)
+  {
+    --offloaded;
+    respond(seq, std::move(result));
   }
 
   // Перехват ошибки декодирования сообщения
   // Посылаем ошибку клиенту
   void on_decode_error() override
   {
+    if (check_pending() == false)
+      return;
     command to_send;
     to_send.type = "error";
-    owner.on_send_command(id, to_send);
+    respond(next_seq++, std::move(to_send));
+  }
+
+  // Проверяет, можно ли принять ещё одну команду, и закрывает соединение, если ответов ждёт слишком много
+  bool check_pending()
+  {
+    if (closing)
+      return false;
+    if (next_seq - next_to_send < max_pending)
+      return true;
+    closing = true;
+    owner.close_connection(id);
+    return false;
+  }
+
+  // Отправляет ответ, если все предыдущие уже отправлены, иначе откладывает его
+  // Вслед за ним отправляются отложенные ответы, которые теперь стоят по порядку
+  void respond(uint32_t seq, command cmd)
+  {
+    if (seq != next_to_send)
+    {
+      tracer.on_held();
+      ready.emplace(seq, std::move(cmd));
+      return;
+    }
+    owner.on_send_command(id, std::move(cmd));
+    ++next_to_send;
+    for (auto it = ready.begin(); it != ready.end() && it->first == next_to_send; it = ready.erase(it))
+    {
+      owner.on_send_command(id, std::move(it->second));
+      ++next_to_send;
+    }
+  }
+
+  static bool parse_count(const command & cmd, uint32_t & count)
+  {
+    auto it = cmd.args.find("count");
+    if (it == cmd.args.end() || it->second.empty() || it->second.size() > 8 ||
+        it->second.find_first_not_of("0123456789") != std::string::npos)
+      return false;
+    count = static_cast<uint32_t>(std::stoul(it->second));
+    return count != 0 && count <= max_simulate_count;
+  }
+
+  static command make_simulated(uint32_t count, const roll_series & series)
+  {
+    command ret;
+    ret.type = "simulated";
+    ret.args.emplace("count", std::to_string(count));
+    ret.args.emplace("sum", std::to_string(series.sum));
+    std::string faces;
+    for (uint64_t n : series.faces)
+    {
+      if (faces.empty() == false)
+        faces.push_back(',');
+      faces += std::to_string(n);
+    }
+    ret.args.emplace("faces", faces);
+    return ret;
   }
 
   const connection_id id;
   client_handler_owner & owner;
   command_decoder decoder;
-  bool got_handshake;
+  admission_control * admission;
+  client_state state;
+  // Номер следующей команды и номер команды, ответ на которую должен уйти следующим
+  uint32_t next_seq = 0;
+  uint32_t next_to_send = 0;
+  // Готовые ответы, ожидающие, пока выполнятся более ранние команды
+  std::map<uint32_t, command> ready;
+  // Серии, отданные в пул и ещё не вернувшиеся
+  uint32_t offloaded = 0;
+  // Соединение закрывается за превышение max_pending, остальные команды не обрабатываются
+  bool closing = false;
 };
 using client_handler_ptr = std::unique_ptr<client_handler>;
 
@@ -1,4 +1,6 @@
 #include "command_decoder.h"
+#include "probes.h"
+#include "request_tracer.h"
 
 namespace
 {
@@ -24,10 +26,15 @@ command_decoder::command_decoder(command_decoder_user & user) :
 
 void command_decoder::add_buffer_and_try_decode(buffer_type buf)
 {
-  buffer.append(buf.begin(), buf.end());
+  add_data_and_try_decode(buf.data(), buf.size());
+}
+
+void command_decoder::add_data_and_try_decode(const uint8_t * data, size_t size)
+{
+  buffer.append(reinterpret_cast<const char *>(data), size);
 
-  // Don't accept messages longer than 1.5Kb
-  if (buffer.size() > 1536)
+  // Don't accept messages longer than max_command_length(1.5Kb by default)
+  if (buffer.size() > max_command_length)
   {
     buffer.clear();
     user.on_decode_error();
@@ -48,6 +55,8 @@ void command_decoder::add_buffer_and_try_decode(buffer_type buf)
 
 void command_decoder::decode_command(std::string_view str)
 {
+  ROLL_PROBE1(decode, str.size());
+  tracer.on_decoded();
   command cmd;
   auto cmd_type_sep = str.find(':');
   // means string is a command by itself
@@ -2,6 +2,7 @@
 #define COMMAND_DECODER_H
 
 #include "common_types.h"
+#include "memory_usage.h"
 
 // Интерфейс пользователя декодера
 // Требуется, т.к. декодер потоковый и гораздо удобнее реализовать такое на неком обратном вызове
@@ -22,10 +23,28 @@ class command_decoder
 public:
   explicit command_decoder(command_decoder_user & user);
 
+  // Максимальная длина команды, общая для всех декодеров, по умолчанию 1.5Kb
+  // Команды длиннее считаются ошибкой
+  static void set_max_command_length(size_t length) { max_command_length = length; }
+  static size_t get_max_command_length() { return max_command_length; }
+
   // Добавить буфер и попытаться сдекодировать
   void add_buffer_and_try_decode(buffer_type buf);
+  // То же самое, но без передачи владения буфером
+  // Полезно, когда буфер переиспользуется, например, при приёме датаграмм
+  void add_data_and_try_decode(const uint8_t * data, size_t size);
+
+  // Нет ли в буфере недодекодированной команды
+  bool empty() const { return buffer.empty(); }
+  // Память, выделенная буфером в куче, короткие строки хранятся внутри объекта
+  size_t memory_usage() const
+  {
+    return buffer.capacity() > std::string().capacity() ? heap_block_size(buffer.capacity() + 1) : 0;
+  }
 
 private:
+  static inline size_t max_command_length = 1536;
+
   command_decoder_user & user;
   std::string buffer;
 
@@ -0,0 +1,109 @@
+#include "completion_queue.h"
+#include <iostream>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+completion_queue::completion_queue() :
+  signaled(false),
+  manager(nullptr),
+  read_fd(-1),
+  write_fd(-1)
+{}
+
+completion_queue::~completion_queue()
+{
+  close();
+}
+
+bool completion_queue::open(connection_manager & manager)
+{
+#if defined(__linux__)
+  read_fd = write_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (read_fd < 0)
+  {
+    std::cerr << "eventfd: " << last_network_error_message() << std::endl;
+    return false;
+  }
+#elif !defined(WIN32)
+  int fds[2];
+  if (::pipe(fds) != 0)
+  {
+    std::cerr << "pipe: " << last_network_error_message() << std::endl;
+    return false;
+  }
+  read_fd = fds[0];
+  write_fd = fds[1];
+  ::fcntl(read_fd, F_SETFL, O_NONBLOCK);
+  ::fcntl(write_fd, F_SETFL, O_NONBLOCK);
+#endif
+
+#ifndef WIN32
+  manager.watch_socket(read_fd, *this);
+#endif
+  this->manager = &manager;
+  return true;
+}
+
+void completion_queue::close()
+{
+#ifndef WIN32
+  if (manager != nullptr)
+    manager->unwatch_socket(read_fd);
+  if (write_fd >= 0 && write_fd != read_fd)
+    ::close(write_fd);
+  if (read_fd >= 0)
+    ::close(read_fd);
+#endif
+  manager = nullptr;
+  read_fd = write_fd = -1;
+}
+
+void completion_queue::post(completion fn)
+{
+  queue.push(std::move(fn));
+  if (signaled.exchange(true) == false)
+    signal();
+}
+
+void completion_queue::signal()
+{
+#if defined(__linux__)
+  uint64_t one = 1;
+  if (::write(write_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    std::cerr << "eventfd write: " << last_network_error_message() << std::endl;
+#elif !defined(WIN32)
+  char one = 1;
+  if (::write(write_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    std::cerr << "pipe write: " << last_network_error_message() << std::endl;
+#endif
+}
+
+void completion_queue::on_socket_readable(SOCKET)
+{
+#ifndef WIN32
+  // Сбрасываем счётчик eventfd(или вычитываем pipe), иначе select сразу вернётся снова
+  char buf[64];
+  while (::read(read_fd, buf, sizeof(buf)) > 0)
+  {}
+#endif
+  drain();
+}
+
+void completion_queue::drain()
+{
+  // Флаг сбрасывается до разбора: всё, что добавят после, снова разбудит цикл
+  signaled.store(false);
+  completion fn;
+  while (queue.pop(fn))
+    fn();
+
+  // Писатель мог успеть вставить узел, но ещё не связать его, тогда pop считает очередь пустой
+  // Будим себя ещё раз, чтобы забрать его на следующей итерации цикла
+  if (queue.maybe_not_empty() && signaled.exchange(true) == false)
+    signal();
+}
@@ -0,0 +1,47 @@
+#ifndef COMPLETION_QUEUE_H
+#define COMPLETION_QUEUE_H
+
+#include "connection_manager.h"
+#include "mpsc_queue.h"
+#include <atomic>
+#include <functional>
+
+// Очередь завершений: через неё потоки пула возвращают результаты в поток ввода-вывода
+// post можно вызывать из любого потока, функции выполняются в цикле менеджера подключений
+// Сама очередь неблокирующая(mpsc_queue), а чтобы разбудить спящий в select цикл,
+//  после добавления пишется в eventfd(на других системах в pipe), который отслеживается как сокет
+// Пишется, только если цикл ещё не был разбужен, так что на пачку результатов приходится одно пробуждение
+// На Windows select не умеет ждать ни то, ни другое, поэтому очередь разбирается только на тике
+class completion_queue : public socket_watcher
+{
+public:
+  using completion = std::function<void()>;
+
+  completion_queue();
+  ~completion_queue() override;
+
+  // Открывает дескриптор пробуждения и начинает отслеживать его в цикле менеджера
+  [[nodiscard]]
+  bool open(connection_manager & manager);
+  void close();
+
+  // Можно вызывать из любого потока
+  void post(completion fn);
+  // Выполняет все накопившиеся функции, вызывается только из цикла менеджера
+  void drain();
+
+  // socket_watcher interface
+  void on_socket_readable(SOCKET sock) override;
+
+private:
+  mpsc_queue<completion> queue;
+  // true, если цикл уже разбужен и ещё не начал разбирать очередь
+  std::atomic<bool> signaled;
+  connection_manager * manager;
+  int read_fd;
+  int write_fd;
+
+  void signal();
+};
+
+#endif // COMPLETION_QUEUE_H
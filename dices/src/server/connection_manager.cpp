@@ -1,14 +1,74 @@
 #include "connection_manager.h"
+#include <algorithm>
+#include <chrono>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#ifndef WIN32
+#include <sys/stat.h>
+#endif
 #include <iostream>
+#include "logger.h"
 #include "network_utils.h"
+#include "memory_usage.h"
+#include "probes.h"
+#include "request_tracer.h"
+#include "tls_transport.h"
+
+namespace
+{
+
+// Сколько отправленных байт может лежать в начале буфера записи, прежде чем их стоит удалить
+constexpr size_t write_compact_threshold = 64 * 1024;
+// Сколько ждать окончания рукопожатия TLS, проверяется на тике, то есть с точностью до секунды
+constexpr std::chrono::seconds tls_handshake_timeout{5};
+
+// Файл Unix-сокета мог остаться от предыдущего запуска, тогда его нужно удалить перед bind
+// Удаляем только сокет, к которому никто не подключается: иначе можно отобрать адрес
+//  у работающего экземпляра сервера или удалить чужой файл
+bool remove_stale_socket(const net_address & address)
+{
+  const std::string path = address.local_path();
+#ifndef WIN32
+  struct stat st;
+  if (::stat(path.c_str(), &st) != 0)
+    return errno == ENOENT;
+  if (S_ISSOCK(st.st_mode) == false)
+  {
+    std::cerr << "not a socket: " << path << std::endl;
+    return false;
+  }
+#endif
+
+  SOCKET probe = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (probe == INVALID_SOCKET)
+    return false;
+  bool refused = ::connect(probe, address.data(), address.size()) == SOCKET_ERROR &&
+                 net_error() == NetConnectionRefused;
+  ::closesocket(probe);
+  if (refused == false)
+  {
+    std::cerr << "socket is in use: " << path << std::endl;
+    return false;
+  }
+  return ::unlink(path.c_str()) == 0 || errno == ENOENT;
+}
+
+}
 
 connection_manager::connection_manager(connection_manager_user & user) :
   user(user),
-  server_socket(INVALID_SOCKET),
+  admission(nullptr),
+  tls(nullptr),
   run(false)
 {}
 
-bool connection_manager::start(const std::string & ip, uint16_t port)
+// Определён здесь, где tls_session уже полный тип
+connection_manager::~connection_manager() = default;
+
+bool connection_manager::start(const std::vector<net_address> & addresses,
+                               const std::vector<net_address> & tls_addresses)
 {
   // Проверяем, что сервер уже запущен.
   // NOTE: для перезапуска сервера на другом адресе/порту, нужно сначала вызвать функцию stop.
@@ -18,33 +78,52 @@ bool connection_manager::start(const std::string & ip, uint16_t port)
     return false;
   }
 
-  SOCKET sock = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (sock == INVALID_SOCKET)
+  // Без слушателей сервер имеет смысл, только если есть сторонние сокеты(например, UDP)
+  if (addresses.empty() && tls_addresses.empty() && watchers.empty())
   {
-    print_last_error("server socket");
+    std::cerr << "no addresses to listen" << std::endl;
     return false;
   }
 
-  sockaddr_in in;
-  ::memset(&in, 0, sizeof(in));
-  in.sin_family = AF_INET;
-  in.sin_addr.s_addr = ::inet_addr(ip.c_str());
-  in.sin_port = ::htons(port);
-  if (::bind(sock, reinterpret_cast<sockaddr *>(&in), sizeof(in)) == SOCKET_ERROR)
+  // Индекс слушателя хранится в connection_data одним байтом
+  if (addresses.size() + tls_addresses.size() > max_listeners)
   {
-    print_last_error("bind server socket");
+    std::cerr << "too many addresses to listen, at most " << max_listeners << " are supported" << std::endl;
     return false;
   }
 
-  if (::listen(sock, 20) == SOCKET_ERROR)
+  if (tls_addresses.empty() == false && tls == nullptr)
   {
-    print_last_error("listen server socket");
+    std::cerr << "no tls context for tls addresses" << std::endl;
     return false;
   }
 
-  server_socket = sock;
+  // Если хоть один адрес не удалось открыть, то не запускаемся вовсе
+  for (const auto & address : addresses)
+  {
+    if (open_listener(address, false) == false)
+    {
+      close_listeners();
+      return false;
+    }
+    if (log_enabled(log_level::info))
+      std::cout << "listen on: " << address.to_string() << std::endl;
+  }
+  for (const auto & address : tls_addresses)
+  {
+    if (open_listener(address, true) == false)
+    {
+      close_listeners();
+      return false;
+    }
+    if (log_enabled(log_level::info))
+      std::cout << "listen tls on: " << address.to_string() << std::endl;
+  }
+
   run = true;
-  return run_loop();
+  bool ret = run_loop();
+  close_listeners();
+  return ret;
 }
 
 void connection_manager::stop()
@@ -70,8 +149,40 @@ void connection_manager::write_to_connection(connection_id id, buffer_type buf)
   if (it == clients.end())
     return;
 
+  // Если отправлять нечего, то просто забираем буфер себе, иначе дописываем в конец
   connection_data & data = it->second;
-  data.write_buf.push(std::move(buf));
+  ROLL_PROBE2(queue, id, buf.size());
+  tracer.on_queued(id);
+  size_t old_capacity = data.write_buf.capacity();
+  if (data.write_buf.empty())
+  {
+    data.write_buf = std::move(buf);
+  }
+  else
+  {
+    // Клиент не успевает читать: удаляем уже отправленное, пока оно занимает больше половины буфера,
+    //  так перенос остатка в начало обходится в среднем не дороже самой записи
+    if (data.write_offset >= write_compact_threshold && data.write_offset * 2 >= data.write_buf.size())
+    {
+      data.write_buf.erase(data.write_buf.begin(), data.write_buf.begin() + data.write_offset);
+      data.write_offset = 0;
+    }
+    data.write_buf.insert(data.write_buf.end(), buf.begin(), buf.end());
+  }
+  account_write_buf(old_capacity, data.write_buf.capacity());
+}
+
+net_address connection_manager::get_peer_address(connection_id id) const
+{
+  auto it = clients.find(id);
+  if (it == clients.end())
+    return {};
+  return address_of(it->second);
+}
+
+size_t connection_manager::memory_usage() const
+{
+  return hash_map_memory(clients) + write_buffers_memory;
 }
 
 void connection_manager::print_last_error(const std::string & text)
@@ -80,50 +191,152 @@ void connection_manager::print_last_error(const std::string & text)
   std::cerr << "Error text: " << text << ", reason: " << reason << std::endl;
 }
 
+void connection_manager::set_loop_options(const loop_options & opts)
+{
+  bool repin = run && opts.cpu != options.cpu;
+  options = opts;
+  // Вызов пришёл из потока цикла, поэтому можно сразу перепривязать его к другому ядру
+  if (repin)
+    pin_thread();
+}
+
+void connection_manager::watch_socket(SOCKET sock, socket_watcher & watcher)
+{
+  watchers[sock] = &watcher;
+}
+
+void connection_manager::unwatch_socket(SOCKET sock)
+{
+  watchers.erase(sock);
+}
+
+bool connection_manager::open_listener(const net_address & address, bool tls)
+{
+  // Для Unix-сокетов протокол не указывается
+  int protocol = address.family() == AF_UNIX ? 0 : IPPROTO_TCP;
+  SOCKET sock = ::socket(address.family(), SOCK_STREAM, protocol);
+  if (sock == INVALID_SOCKET)
+  {
+    print_last_error("server socket " + address.to_string());
+    return false;
+  }
+
+  int on = 1;
+  if (address.family() == AF_INET6)
+  {
+    // IPv6-сокет должен принимать только IPv6, чтобы на том же порту можно было слушать и IPv4
+    ::setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char *>(&on), sizeof(on));
+  }
+  if (address.family() == AF_UNIX)
+  {
+    if (remove_stale_socket(address) == false)
+    {
+      ::closesocket(sock);
+      return false;
+    }
+  }
+  else
+  {
+    ::setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&on), sizeof(on));
+  }
+
+  if (::bind(sock, address.data(), address.size()) == SOCKET_ERROR)
+  {
+    print_last_error("bind server socket " + address.to_string());
+    ::closesocket(sock);
+    return false;
+  }
+
+  if (::listen(sock, options.listen_backlog) == SOCKET_ERROR)
+  {
+    print_last_error("listen server socket " + address.to_string());
+    ::closesocket(sock);
+    return false;
+  }
+
+  apply_busy_poll(sock);
+  listeners.push_back(listener{sock, address, tls});
+  return true;
+}
+
+void connection_manager::close_listeners()
+{
+  for (const auto & lst : listeners)
+  {
+    ::closesocket(lst.sock);
+    if (lst.address.family() == AF_UNIX)
+      ::unlink(lst.address.local_path().c_str());
+  }
+  listeners.clear();
+}
+
 bool connection_manager::run_loop()
 {
   //TODO: использовать IOCP на Windows и epoll на Linux если нужно будет больше производительности
 
+  pin_thread();
+
   fd_set read_fds;
   fd_set write_fds;
   fd_set except_fds;
 
-  // select будет засыпать на секунду
-  timeval tv;
-  tv.tv_sec = 1;
-  tv.tv_usec = 0;
+  auto last_tick = std::chrono::steady_clock::now();
 
   // Цикл работает пока нет ошибок и сервер запущен
   while (run)
   {
+    // Тик идёт до удаления отключённых сокетов: на нём тоже закрываются соединения,
+    //  а закрытый сокет не должен попасть в select
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_tick >= std::chrono::seconds(1))
+    {
+      last_tick = now;
+      expire_handshakes(now);
+      user.on_tick();
+    }
+
     // Удаляем отключённые сокеты
     process_disconnecting();
 
     // Подготавливаем каждый fd_set
-    prepare_fds(read_fds, write_fds, except_fds);
+    SOCKET max_fd = prepare_fds(read_fds, write_fds, except_fds);
 
-    int res = ::select(0, &read_fds, &write_fds, &except_fds, &tv);
+    int res = wait_events(max_fd, read_fds, write_fds, except_fds);
     switch (res)
     {
     // Произошла ошибка в select
     case SOCKET_ERROR:
+      // Прерывание сигналом не является ошибкой, например, так приходит команда на остановку
+      if (net_error() == NetInterrupted)
+        continue;
       print_last_error("select");
       return false;
     // Ничего не произошло
     case 0:
       continue;
     default:
-      // Сначала обрабатываем серверный сокет, хотя это не имеет особой пользы,
+      // Сначала обрабатываем серверные сокеты, хотя это не имеет особой пользы,
       // клиенты могут обрабатываться раньше
-      if (FD_ISSET(server_socket, &read_fds))
+      for (const auto & lst : listeners)
       {
-        handle_accept();
+        if (FD_ISSET(lst.sock, &read_fds))
+        {
+          handle_accept(lst);
+        }
+
+        if (FD_ISSET(lst.sock, &except_fds))
+        {
+          print_last_error("server sock " + lst.address.to_string());
+          return false;
+        }
       }
 
-      if (FD_ISSET(server_socket, &except_fds))
+      for (auto & [sock, watcher] : watchers)
       {
-        print_last_error("server sock");
-        return false;
+        if (FD_ISSET(sock, &read_fds))
+        {
+          watcher->on_socket_readable(sock);
+        }
       }
 
       for (auto & [client, data] : clients)
@@ -155,54 +368,171 @@ bool connection_manager::run_loop()
   return true;
 }
 
+int connection_manager::wait_events(SOCKET max_fd, fd_set & read_fds, fd_set & write_fds, fd_set & except_fds)
+{
+  // В режиме активного ожидания опрашиваем сокеты без сна, пока не истечёт бюджет
+  // select модифицирует наборы, поэтому опрашиваем копии
+  if (options.spin_us != 0)
+  {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(options.spin_us);
+    do
+    {
+      fd_set read_copy = read_fds;
+      fd_set write_copy = write_fds;
+      fd_set except_copy = except_fds;
+      timeval zero;
+      zero.tv_sec = 0;
+      zero.tv_usec = 0;
+      int res = ::select(max_fd + 1, &read_copy, &write_copy, &except_copy, &zero);
+      if (res > 0)
+      {
+        read_fds = read_copy;
+        write_fds = write_copy;
+        except_fds = except_copy;
+      }
+      if (res != 0)
+        return res;
+    } while (run && std::chrono::steady_clock::now() < deadline);
+  }
+
+  // select будет засыпать на select_timeout_ms(по умолчанию на секунду)
+  // Linux изменяет timeval, поэтому выставляем его на каждой итерации
+  timeval tv;
+  tv.tv_sec = options.select_timeout_ms / 1000;
+  tv.tv_usec = (options.select_timeout_ms % 1000) * 1000;
+
+  // На Windows первый аргумент игнорируется
+  return ::select(max_fd + 1, &read_fds, &write_fds, &except_fds, &tv);
+}
+
+void connection_manager::apply_busy_poll(SOCKET sock)
+{
+#ifdef __linux__
+  if (options.busy_poll_us == 0)
+    return;
+
+  // Без CAP_NET_ADMIN ядро не даст выставить значение больше net.core.busy_read,
+  //  поэтому ошибку печатаем только один раз
+  static bool warned = false;
+  int usec = options.busy_poll_us;
+  int prefer = 1;
+  if ((::setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == SOCKET_ERROR ||
+       ::setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) == SOCKET_ERROR) &&
+      warned == false)
+  {
+    warned = true;
+    print_last_error("busy poll socket option");
+  }
+#else
+  (void)sock;
+#endif
+}
+
+void connection_manager::pin_thread()
+{
+  if (options.cpu < 0)
+    return;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(options.cpu, &set);
+  int err = ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+  if (err != 0)
+    std::cerr << "cannot pin to cpu " << options.cpu << ": " << ::strerror(err) << std::endl;
+  else if (log_enabled(log_level::info))
+    std::cout << "event loop pinned to cpu " << options.cpu << std::endl;
+#else
+  std::cerr << "cpu pinning is supported only on Linux" << std::endl;
+#endif
+}
+
 void connection_manager::process_disconnecting()
 {
-  // Проходим по всем для удаления и удаляем их, предварительно отдавая клиенту все данные,
-  //  которые успели прийти и не были ещё отданы
+  // Проходим по всем для удаления и удаляем их
+  // Все принятые данные к этому моменту уже отданы пользователю в handle_read
   for (auto & [client, data] : to_delete)
   {
-    clients.erase(client);
-    flush_data(client, data);
+    if (admission != nullptr)
+      admission->release(admission_control::address_key(address_of(data)));
+    // Пока соединение ждало удаления, в оставшуюся в clients запись могли дописать ответ
+    auto it = clients.find(client);
+    if (it != clients.end())
+    {
+      account_write_buf(it->second.write_buf.capacity(), 0);
+      clients.erase(it);
+    }
+    account_write_buf(data.write_buf.capacity(), 0);
+    // О соединении, не закончившем рукопожатие TLS, пользователь не знает
+    if (data.announced == false)
+      continue;
+    tracer.on_closed(client);
     user.on_connection_closed(client);
   }
   to_delete.clear();
 }
 
-void connection_manager::prepare_fds(fd_set & read_fds, fd_set & write_fds, fd_set & except_fds)
+// Возвращает максимальный дескриптор среди добавленных
+SOCKET connection_manager::prepare_fds(fd_set & read_fds, fd_set & write_fds, fd_set & except_fds)
 {
   FD_ZERO(&read_fds);
   FD_ZERO(&write_fds);
   FD_ZERO(&except_fds);
 
-  FD_SET(server_socket, &read_fds);
-  FD_SET(server_socket, &except_fds);
+  SOCKET max_fd = 0;
+  for (const auto & lst : listeners)
+  {
+    FD_SET(lst.sock, &read_fds);
+    FD_SET(lst.sock, &except_fds);
+    max_fd = std::max(max_fd, lst.sock);
+  }
+
+  for (const auto & [sock, watcher] : watchers)
+  {
+    FD_SET(sock, &read_fds);
+    max_fd = std::max(max_fd, sock);
+  }
 
   for (auto & [client, data] : clients)
   {
     FD_SET(client, &read_fds);
     // Добавляем если только есть что писать
-    if (data.write_buf.empty() == false)
+    // Рукопожатию TLS тоже бывает нужно дождаться, пока сокет станет доступен для записи
+    if (data.write_buf.empty() == false || (data.tls != nullptr && data.tls->wants_write()))
       FD_SET(client, &write_fds);
     FD_SET(client, &except_fds);
+    max_fd = std::max(max_fd, client);
   }
+  return max_fd;
 }
 
-void connection_manager::handle_accept()
+void connection_manager::handle_accept(const listener & lst)
 {
-  sockaddr_in client_addr;
-  ::memset(&client_addr, 0, sizeof(client_addr));
-  socklen_t addr_len = sizeof(client_addr);
+  net_address client_addr;
+  socklen_t addr_len = net_address::capacity();
 
   // Принимаем нового клиента и делаем сокет неблокирующим,
   //  чтобы вызовы send/recv не были блокирующими
-  SOCKET client = ::accept(server_socket,
-                           reinterpret_cast<sockaddr *>(&client_addr), &addr_len);
+  SOCKET client = ::accept(lst.sock, client_addr.data(), &addr_len);
   if (client == INVALID_SOCKET)
   {
     print_last_error("accept");
     return;
   }
 
+  // select не умеет следить за сокетом вне FD_SETSIZE, а FD_SET за его пределами портит стек
+  // Проверка нужна и без admission_control: его лимиты можно выключить(--unlimited)
+#ifdef WIN32
+  if (clients.size() + listeners.size() + watchers.size() >= FD_SETSIZE)
+#else
+  if (client >= FD_SETSIZE)
+#endif
+  {
+    ::closesocket(client);
+    if (log_enabled(log_level::info))
+      std::cout << "too many sockets for select, connection rejected" << std::endl;
+    return;
+  }
+
   u_long val = 1;
 #ifdef WIN32
   if (::ioctlsocket(client, FIONBIO, &val) == SOCKET_ERROR)
@@ -214,8 +544,22 @@ void connection_manager::handle_accept()
     print_last_error("ioctrlsocket");
     return;
   }
+  apply_busy_poll(client);
+
+  client_addr.set_size(addr_len);
 
-  std::cout << "accepted from: " << get_peer_address(client_addr) << std::endl;
+  // Отказ должен быть дешёвым: сразу закрываем сокет, ничего не логируя
+  if (admission != nullptr &&
+      admission->try_admit(admission_control::address_key(client_addr)) == false)
+  {
+    ::closesocket(client);
+    return;
+  }
+  // Адрес клиента Unix-сокета безымянный, поэтому запоминаем адрес слушателя
+  if (client_addr.family() == AF_UNIX && client_addr.local_path().empty())
+    client_addr = lst.address;
+  if (log_enabled(log_level::info))
+    std::cout << "accepted from: " << client_addr.to_string() << std::endl;
 
   // Это ок, т.к. клиенты ещё не начали обрабатываться
   auto [it, ok] = clients.insert(std::make_pair(client, connection_data{}));
@@ -223,125 +567,230 @@ void connection_manager::handle_accept()
   {
     std::cerr << "Cannot insert new peer" << std::endl;
     ::closesocket(client);
+    if (admission != nullptr)
+      admission->release(admission_control::address_key(client_addr));
     return;
   }
 
-  // Оповещаем пользователя
   connection_data & data = it->second;
-  data.address = client_addr;
+  data.address = client_addr.compact();
+  data.listener = static_cast<uint8_t>(&lst - listeners.data());
+  ROLL_PROBE1(accept, client);
+
+  // Соединение с TLS-слушателя отдаём пользователю только после рукопожатия,
+  //  первое сообщение клиента придёт в handle_read
+  if (lst.tls)
+  {
+    data.tls = tls_session::accept(*tls, client);
+    if (data.tls == nullptr)
+      handle_disconnect(client, data);
+    else
+      handshakes.emplace_back(data.tls->accepted_at(), client);
+    return;
+  }
+
+  // Оповещаем пользователя
+  data.announced = true;
   user.on_connection(client);
 }
 
 void connection_manager::handle_read(SOCKET client, connection_data & data)
 {
+  if (data.tls != nullptr && data.tls->established() == false)
+  {
+    handle_handshake(client, data);
+    return;
+  }
+
   buffer_type buf;
   ssize_t received_count = 0;
+  bool failed = false;
+  bool remote_closed = false;
 
   // Алгоритм:
-  // Принимаем по 256 байт, если операция может быть блокирована, то прерываем цикл
-  // Если принято 0 байт, значит клиент отключился, сообщаем об этом
-  // Иначе добавляем в буфер и пробуем принять снова
+  // Принимаем по recv_chunk байт в конец общего буфера, если операция может быть блокирована, то прерываем цикл
+  // Если принято 0 байт, значит клиент отключился
+  // Иначе пробуем принять снова
+  // Всё принятое отдаётся пользователю одним буфером, даже если клиент отключился
+  // Если приём TLS расшифровывает ядро, recv сразу отдаёт открытый текст, иначе читаем через сессию
   do
   {
-    buf.resize(256);
+    size_t old_size = buf.size();
+    const uint32_t chunk = options.recv_chunk;
+    buf.resize(old_size + chunk);
 
-    received_count = ::recv(client, reinterpret_cast<char *>(buf.data()), buf.size(), 0);
+    bool via_session = data.tls != nullptr && data.tls->ktls_recv() == false;
+    if (via_session)
+      received_count = data.tls->read(buf.data() + old_size, chunk);
+    else
+      received_count = ::recv(client, reinterpret_cast<char *>(buf.data() + old_size), chunk, 0);
     if (received_count < 0)
     {
+      buf.resize(old_size);
       int err = net_error();
-      if (err == NetWouldBlock || err == NetAgain)
-        break;
-      handle_disconnect(client, data);
-      return;
+      if (via_session ? data.tls->would_block() == false : err != NetWouldBlock && err != NetAgain)
+        failed = true;
+      break;
     }
     else if (received_count == 0)
     {
-      handle_disconnect_remote(client, data);
-      return;
+      buf.resize(old_size);
+      remote_closed = true;
+      break;
     }
 
     // Избавляемся от нулей в конце
-    buf.resize(received_count);
-    data.read_buf.push(std::move(buf));
-    buf.clear();
+    buf.resize(old_size + received_count);
   } while (received_count > 0);
 
   // Посылаем данные клиенту
-  flush_data(client, data);
+  if (buf.empty() == false)
+  {
+    ROLL_PROBE2(read, client, buf.size());
+    tracer.on_read(client);
+    user.on_connection_read(client, std::move(buf));
+    tracer.on_read_done();
+  }
+
+  if (failed)
+    handle_disconnect(client, data);
+  else if (remote_closed)
+    handle_disconnect_remote(client, data);
 }
 
 void connection_manager::handle_write(SOCKET client, connection_data & data)
 {
+  if (data.tls != nullptr && data.tls->established() == false)
+  {
+    handle_handshake(client, data);
+    return;
+  }
+
   // Нечего делать
+  // Разве что SSL_read не смог отправить служебную запись(WANT_WRITE) и ждал готовности сокета к записи:
+  //  тогда повторяем чтение, иначе select так и будет сообщать о готовности к записи
   if (data.write_buf.empty())
+  {
+    if (data.tls != nullptr && data.tls->wants_write())
+      handle_read(client, data);
     return;
+  }
 
-  // Пытаемся послать, если может быть блокирована, то просто ничего не делаем
-  // Если записали не весь буфер, то вставляем его обратно,
-  // иначе извлекаем из очереди буфер и забываем о нём
-  auto buf = std::move(data.write_buf.front());
-  int res = ::send(client, reinterpret_cast<const char *>(buf.data()), buf.size(), 0);
+  // Пытаемся послать всё, что накопилось, если может быть блокирована, то просто ничего не делаем
+  // Если записали не весь буфер, то запоминаем, сколько уже отправлено,
+  // иначе освобождаем буфер
+  const uint8_t * ptr = data.write_buf.data() + data.write_offset;
+  size_t size = data.write_buf.size() - data.write_offset;
+  // Если передачу TLS шифрует ядро, send отправляет открытый текст, иначе пишем через сессию
+  bool via_session = data.tls != nullptr && data.tls->ktls_send() == false;
+  int res = via_session ? static_cast<int>(data.tls->write(ptr, size))
+                        : ::send(client, reinterpret_cast<const char *>(ptr), size, 0);
+  ROLL_PROBE3(write, client, res, size - std::max(res, 0));
   // Not sent at all
   if (res < 0)
   {
     int err = net_error();
-    if (err == NetWouldBlock || err == NetAgain)
-    {
-      data.write_buf.front() = std::move(buf);
-    }
-    else
+    if (via_session ? data.tls->would_block() == false : err != NetWouldBlock && err != NetAgain)
     {
       handle_disconnect(client, data);
     }
   }
-  // Not full buffer sent, write back remain data
-  else if (res != buf.size())
+  // Not full buffer sent, remember position
+  else if (static_cast<size_t>(res) != size)
   {
-    buf.erase(buf.begin(), buf.begin() + res);
-    data.write_buf.front() = std::move(buf);
+    data.write_offset += res;
   }
   // All fine
   else
   {
-    data.write_buf.pop();
+    size_t old_capacity = data.write_buf.capacity();
+    buffer_type().swap(data.write_buf);
+    data.write_offset = 0;
+    account_write_buf(old_capacity, data.write_buf.capacity());
+    tracer.on_written(client);
+  }
+}
+
+void connection_manager::handle_handshake(SOCKET client, connection_data & data)
+{
+  if (data.tls->handshake() == false)
+  {
+    handle_disconnect(client, data);
+    return;
+  }
+  if (data.tls->established() == false)
+    return;
+
+  if (log_enabled(log_level::info))
+    std::cout << "tls with: " << address_of(data).to_string() << ", " << data.tls->description()
+              << std::endl;
+  data.announced = true;
+  user.on_connection(client);
+  // Первые данные клиента могли прийти вместе с концом рукопожатия и уже лежать в буфере сессии,
+  //  select о них не сообщит, поэтому сразу пробуем читать
+  if (to_delete.count(client) == 0)
+    handle_read(client, data);
+}
+
+void connection_manager::expire_handshakes(std::chrono::steady_clock::time_point now)
+{
+  // Соединения добавляются в порядке приёма, поэтому просроченные всегда в начале
+  // Запись устарела, если соединение уже закрыто или сокет достался другому соединению
+  while (handshakes.empty() == false && now - handshakes.front().first >= tls_handshake_timeout)
+  {
+    auto [accepted, client] = handshakes.front();
+    handshakes.pop_front();
+    auto it = clients.find(client);
+    if (it == clients.end())
+      continue;
+    connection_data & data = it->second;
+    if (data.tls != nullptr && data.tls->established() == false && data.tls->accepted_at() == accepted)
+      handle_disconnect(client, data);
   }
 }
 
 void connection_manager::handle_disconnect(SOCKET client, connection_data & data)
 {
+  // Соединение уже могло быть закрыто, например, пользователем из on_connection_read
+  if (to_delete.count(client) != 0)
+    return;
+
+  if (data.tls != nullptr)
+    data.tls->shutdown();
+
   // Закрываем сокет, дабы не принимать по нему больше сообщений//
   ::closesocket(client);
 
-  std::cout << "disconnect peer with address: " << get_peer_address(data.address)
-            << std::endl;
+  if (log_enabled(log_level::info))
+    std::cout << "disconnect peer with address: " << address_of(data).to_string()
+              << std::endl;
   to_delete.emplace(client, std::move(data));
 }
 
 void connection_manager::handle_disconnect_remote(SOCKET client, connection_data & data)
 {
+  if (to_delete.count(client) != 0)
+    return;
+
   // Закрываем сокет, дабы не принимать по нему больше сообщений//
   ::closesocket(client);
 
-  std::cout << "peer with address: " << get_peer_address(data.address)
-            << " closed connection" << std::endl;
+  if (log_enabled(log_level::info))
+    std::cout << "peer with address: " << address_of(data).to_string()
+              << " closed connection" << std::endl;
   to_delete.emplace(client, std::move(data));
 }
 
-void connection_manager::flush_data(connection_id id, connection_data & data)
+net_address connection_manager::address_of(const connection_data & data) const
 {
-  // Чистим очередь входящих сообщений, отдавая их пользователю
-  while (data.read_buf.empty() == false)
-  {
-    user.on_connection_read(id, std::move(data.read_buf.front()));
-    data.read_buf.pop();
-  }
+  // Для Unix-сокетов путь не хранится, берём адрес слушателя
+  if (data.address.family == AF_UNIX && data.listener < listeners.size())
+    return listeners[data.listener].address;
+  return net_address::from_compact(data.address);
 }
 
-// Функция преобразовывает стуктуру с IPv4 адресом в строку
-std::string connection_manager::get_peer_address(const sockaddr_in & addr)
+void connection_manager::account_write_buf(size_t old_capacity, size_t new_capacity)
 {
-  std::string ret = ::inet_ntoa(addr.sin_addr);
-  ret += ":";
-  ret += std::to_string(::ntohs(addr.sin_port));
-  return ret;
+  write_buffers_memory += heap_block_size(new_capacity);
+  write_buffers_memory -= heap_block_size(old_capacity);
 }
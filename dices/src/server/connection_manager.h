@@ -3,12 +3,24 @@
 
 #include "network_utils.h"
 #include "common_types.h"
+#include "net_address.h"
+#include "admission_control.h"
 #include <unordered_map>
 #include <string>
-#include <queue>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
 
-// В файле представлен класс для управления асинхронным TCP-сервером
-// На данный момент поддерживает только IPv4-соединения
+// В файле представлен класс для управления асинхронным сервером
+// Поддерживает потоковые соединения по IPv4, IPv6 и Unix-сокетам,
+//  причём может слушать сразу несколько адресов
+// Соединения на TLS-адресах сначала проходят рукопожатие, и только потом о них узнаёт пользователь,
+//  дальше он работает с открытым текстом, как и для обычных соединений
+
+class tls_context;
+class tls_session;
 
 // Пользователь TCP-сервера, получает уведомления о создании и уничтожении соединения,
 //  а также об том, что получено сообщение
@@ -21,39 +33,124 @@ struct connection_manager_user
   virtual void on_connection_closed(connection_id id) = 0;
   // Вызывается, когда удалённая сторона прислыает сообщение
   virtual void on_connection_read(connection_id id, buffer_type buf) = 0;
+  // Вызывается из цикла сервера примерно раз в секунду, например, для обслуживания простаивающих сессий
+  virtual void on_tick() {}
+};
+
+// Обработчик стороннего сокета, за которым менеджер следит в своём цикле
+// Нужен, чтобы другие транспорты(например, UDP) работали в том же потоке без отдельного цикла
+struct socket_watcher
+{
+  virtual ~socket_watcher() = default;
+  // Вызывается, когда в сокете есть данные для чтения
+  virtual void on_socket_readable(SOCKET sock) = 0;
+};
+
+// Настройки цикла обработки событий
+// Все, кроме listen_backlog, можно менять на лету из обработчиков цикла
+// Режим низких задержек(spin_us, busy_poll_us, cpu) по умолчанию выключен и цикл засыпает в select
+struct loop_options
+{
+  // Длина очереди соединений слушающего сокета, применяется только при запуске
+  int listen_backlog = 20;
+  // Размер куска, которым принимаются данные из сокета
+  uint32_t recv_chunk = 256;
+  // Сколько select спит, если событий нет
+  uint32_t select_timeout_ms = 1000;
+  // Сколько микросекунд опрашивать сокеты без сна, прежде чем заснуть в select
+  // Каждое пробуждение стоит несколько микросекунд, активное ожидание их экономит ценой загрузки ядра
+  uint32_t spin_us = 0;
+  // Значение SO_BUSY_POLL(и SO_PREFER_BUSY_POLL) для сокетов, только на Linux, 0 - не выставлять
+  int busy_poll_us = 0;
+  // Ядро процессора, к которому привязывается поток цикла, -1 - не привязывать
+  int cpu = -1;
 };
 
 // Класс TCP-сервера, имеет довольно аскетичный интерфейс.
 class connection_manager
 {
 public:
+  // Сколько адресов(вместе с TLS) может слушать один менеджер
+  static constexpr size_t max_listeners = 256;
+
   connection_manager(connection_manager_user & user);
+  ~connection_manager();
 
-  // Функции передаются IP-адрес и порт, на которые сервер должен принимать соединения
+  // Функции передаются адреса, на которые сервер должен принимать соединения
+  // На tls_addresses соединения шифруются, для них нужно заранее вызвать set_tls_context
   // Функция блокирует поток выполнения в случае успешного старта и в конце возвращает true
   // Если запуск неуспешен, то возвращает false и не блокирует поток
   // Может вернуть false во время работы, если произойдёт какая-то серьёзная ошибка
   [[nodiscard]]
-  bool start(const std::string & ip, uint16_t port);
+  bool start(const std::vector<net_address> & addresses,
+             const std::vector<net_address> & tls_addresses = {});
   // Останавливает сервер.
+  // Можно вызывать из обработчика сигнала
   void stop();
 
   // Закрыть соединение со своей стороны
   void close_connection(connection_id id);
   // Послать удалённой стороне некое сообщение
   void write_to_connection(connection_id id, buffer_type buf);
+  // Адрес удалённой стороны, пустой если такого соединения нет
+  net_address get_peer_address(connection_id id) const;
+  // Оценка памяти, занимаемой всеми соединениями, в байтах
+  size_t memory_usage() const;
+
+  // Настройки цикла, можно вызывать и во время работы из обработчиков цикла
+  // Новое значение busy_poll_us применяется только к новым сокетам
+  void set_loop_options(const loop_options & opts);
+  const loop_options & get_loop_options() const { return options; }
+
+  // Подсистема ограничения нагрузки, с которой сверяется каждое новое соединение
+  // Владение не передаётся, nullptr отключает ограничения
+  void set_admission_control(admission_control * control) { admission = control; }
+
+  // Контекст для TLS-слушателей, владение не передаётся, должен жить, пока работает сервер
+  void set_tls_context(tls_context * context) { tls = context; }
+
+  // Начать следить за чтением из стороннего сокета, владение сокетом не передаётся
+  // Менять набор сокетов из обработчика on_socket_readable нельзя
+  void watch_socket(SOCKET sock, socket_watcher & watcher);
+  void unwatch_socket(SOCKET sock);
 
 private:
   connection_manager_user & user;
-  SOCKET server_socket;
-  bool run;
+  admission_control * admission;
+  tls_context * tls;
+  loop_options options;
+  std::atomic<bool> run;
+
+  // Слушающий сокет и адрес, на котором он принимает соединения
+  struct listener
+  {
+    SOCKET sock;
+    net_address address;
+    bool tls;
+  };
+  std::vector<listener> listeners;
+  // Сторонние сокеты и их обработчики
+  std::unordered_map<SOCKET, socket_watcher *> watchers;
 
   // Старуктура, хранящая в себе различные данные, связанные с соединением
+  // Должна быть как можно меньше, т.к. простаивающих соединений может быть очень много
   struct connection_data
   {
-    std::queue<buffer_type> write_buf;
-    std::queue<buffer_type> read_buf;
-    sockaddr_in address;
+    // Все данные на отправку копятся в одном буфере, write_offset - сколько из него уже отправлено
+    // Когда всё отправлено, память буфера освобождается, а отправленное начало буфера
+    //  удаляется, если клиент медленно читает и буфер продолжает расти
+    buffer_type write_buf;
+    size_t write_offset = 0;
+    compact_address address;
+    // Индекс слушателя, принявшего соединение, по нему восстанавливается адрес Unix-сокета
+    // Одного байта хватает, т.к. start не принимает больше max_listeners адресов
+    uint8_t listener = 0;
+    // Пользователь получил on_connection, значит, должен получить и on_connection_closed
+    // Для TLS по состоянию сессии этого не понять: shutdown при закрытии сбрасывает established
+    bool announced = false;
+    // Сессия TLS, только для соединений с TLS-слушателей
+    // Пока рукопожатие не закончено, пользователь о соединении не знает
+    std::unique_ptr<tls_session> tls;
   };
 
   // Карта сокета на данные соединения
@@ -64,18 +161,29 @@ private:
   //  поэтому если нам нужно закрыть соединение, мы заносим его в эту карту и,
   //  на следующем проходе цикла сначала будут удалены все клиенты, а потом уже начнётся обработка новых
   map_clients to_delete;
+  // Память буферов записи всех соединений, считается при изменении буферов, чтобы не обходить соединения
+  size_t write_buffers_memory = 0;
+  // Соединения с TLS-слушателей в порядке приёма, по ним на тике закрываются незаконченные рукопожатия
+  std::deque<std::pair<std::chrono::steady_clock::time_point, SOCKET>> handshakes;
 
   void print_last_error(const std::string & text);
+  bool open_listener(const net_address & address, bool tls);
+  void close_listeners();
   bool run_loop();
   void process_disconnecting();
-  void prepare_fds(fd_set & read_fds, fd_set & write_fds, fd_set & except_fds);
-  void handle_accept();
+  SOCKET prepare_fds(fd_set & read_fds, fd_set & write_fds, fd_set & except_fds);
+  int wait_events(SOCKET max_fd, fd_set & read_fds, fd_set & write_fds, fd_set & except_fds);
+  void apply_busy_poll(SOCKET sock);
+  void pin_thread();
+  void handle_accept(const listener & lst);
   void handle_read(SOCKET client, connection_data & data);
   void handle_write(SOCKET client, connection_data & data);
+  void handle_handshake(SOCKET client, connection_data & data);
+  void expire_handshakes(std::chrono::steady_clock::time_point now);
   void handle_disconnect(SOCKET client, connection_data & data);
   void handle_disconnect_remote(SOCKET client, connection_data & data);
-  void flush_data(connection_id id, connection_data & data);
-  std::string get_peer_address(const sockaddr_in & addr);
+  net_address address_of(const connection_data & data) const;
+  void account_write_buf(size_t old_capacity, size_t new_capacity);
 };
 
 #endif // CONNECTION_MANAGER_H
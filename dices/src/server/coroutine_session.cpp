@@ -0,0 +1,434 @@
+#include "coroutine_session.h"
+#include "client_handler.h"
+#include "command_encoder.h"
+#include "dice.h"
+#include "logger.h"
+#include "memory_usage.h"
+#include "probes.h"
+#include "request_tracer.h"
+#include <iostream>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
+void session_task::promise_type::unhandled_exception()
+{
+  // Исключение завершает сопрограмму, а вместе с ней и соединение
+  try
+  {
+    throw;
+  }
+  catch (const std::exception & e)
+  {
+    std::cerr << "session failed: " << e.what() << std::endl;
+  }
+}
+
+coro_session::coro_session(coro_host & host, connection_id id, uint64_t generation, uint64_t address_key) :
+  host(host),
+  id(id),
+  generation(generation),
+  address_key(address_key),
+  decoder(*this)
+{}
+
+void coro_session::read_awaiter::await_suspend(std::coroutine_handle<> h)
+{
+  suspended = true;
+  s.suspend(h, wait_kind::read);
+}
+
+command coro_session::read_awaiter::await_resume()
+{
+  if (suspended)
+    return std::move(*std::exchange(s.incoming, nullptr));
+  command cmd = std::move(s.inbox.front());
+  s.inbox.pop_front();
+  return cmd;
+}
+
+void coro_session::timed_read_awaiter::await_suspend(std::coroutine_handle<> h)
+{
+  read_awaiter::await_suspend(h);
+  if (timeout.count() > 0)
+    s.host.add_timer(s, timeout);
+}
+
+std::optional<command> coro_session::timed_read_awaiter::await_resume()
+{
+  if (suspended && s.incoming == nullptr)
+    return std::nullopt;
+  return read_awaiter::await_resume();
+}
+
+std::suspend_never coro_session::send(command cmd)
+{
+  host.owner.on_send_command(id, std::move(cmd));
+  return {};
+}
+
+void coro_session::sleep_awaiter::await_suspend(std::coroutine_handle<> h)
+{
+  s.suspend(h, wait_kind::sleep);
+  s.host.add_timer(s, duration);
+}
+
+bool coro_session::task_awaiter::await_suspend(std::coroutine_handle<> h)
+{
+  // Без пула потоков результат приходит прямо внутри run_task,
+  //  тогда не приостанавливаемся, а сразу забираем его в await_resume
+  s.waiting = wait_kind::task;
+  uint64_t token = s.wait_token;
+  coro_host * host = &s.host;
+  connection_id id = s.id;
+  uint64_t generation = s.generation;
+  host->owner.run_task(std::move(task), [host, id, generation, token](command result)
+  {
+    host->task_done(id, generation, token, std::move(result));
+  });
+  if (s.waiting == wait_kind::none)
+    return false;
+  s.suspended = h;
+  return true;
+}
+
+bool coro_session::allow_command()
+{
+  return host.admission == nullptr || host.admission->allow_command(address_key, bucket);
+}
+
+void coro_session::fill_stats(command::arguments_type & args)
+{
+  host.owner.fill_stats(args);
+}
+
+void coro_session::on_decoded_command(command cmd)
+{
+  // Сопрограмма ждёт команду: продолжаем её прямо отсюда, минуя очередь
+  if (closing)
+    return;
+  if (waiting == wait_kind::read)
+  {
+    resume_with(&cmd);
+  }
+  else if (inbox.size() >= max_inbox)
+  {
+    closing = true;
+    host.owner.close_connection(id);
+  }
+  else
+  {
+    inbox.push_back(std::move(cmd));
+  }
+}
+
+void coro_session::on_decode_error()
+{
+  on_decoded_command(command{});
+}
+
+size_t coro_session::memory_usage() const
+{
+  return heap_block_size(sizeof(*this)) + decoder.memory_usage() +
+         inbox.size() * sizeof(command);
+}
+
+void coro_session::suspend(std::coroutine_handle<> h, wait_kind kind)
+{
+  suspended = h;
+  waiting = kind;
+}
+
+void coro_session::resume_with(command * value)
+{
+  incoming = value;
+  waiting = wait_kind::none;
+  ++wait_token;
+  host.cancel_timer(*this);
+  // Результат задачи без пула приходит ещё до приостановки, тогда продолжать некого
+  if (suspended == nullptr)
+    return;
+  std::exchange(suspended, nullptr).resume();
+  host.check_finished(*this);
+}
+
+coro_host::coro_host(coro_host_owner & owner) :
+  owner(owner),
+  admission(nullptr),
+  handshake_timeout(0),
+  next_generation(0),
+  sessions_memory(0),
+  manager(nullptr),
+  timer_fd(-1)
+{}
+
+coro_host::~coro_host()
+{
+  // Кадры сопрограмм уничтожаются раньше пула
+  sessions.clear();
+  close_timers();
+}
+
+bool coro_host::open_timers(connection_manager & manager)
+{
+#ifdef __linux__
+  timer_fd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer_fd < 0)
+  {
+    std::cerr << "timerfd: " << last_network_error_message() << std::endl;
+    return false;
+  }
+  manager.watch_socket(timer_fd, *this);
+  this->manager = &manager;
+#else
+  (void)manager;
+#endif
+  return true;
+}
+
+void coro_host::close_timers()
+{
+#ifdef __linux__
+  if (manager != nullptr)
+    manager->unwatch_socket(timer_fd);
+  if (timer_fd >= 0)
+    ::close(timer_fd);
+#endif
+  manager = nullptr;
+  timer_fd = -1;
+}
+
+void coro_host::open(connection_id id, uint64_t address_key)
+{
+  // Как и в application, сессию соединения, о закрытии которого не сообщили, не наследуем
+  if (sessions.count(id) != 0)
+  {
+    std::cerr << "replacing stale session for id: " << id << std::endl;
+    close(id);
+  }
+  auto sess = std::make_unique<coro_session>(*this, id, ++next_generation, address_key);
+  coro_session & s = *sess;
+  s.task = dice_session(s);
+  sessions[id] = std::move(sess);
+  s.task.start();
+  check_finished(s);
+  account(s);
+}
+
+void coro_host::close(connection_id id)
+{
+  auto it = sessions.find(id);
+  if (it == sessions.end())
+    return;
+  cancel_timer(*it->second);
+  sessions_memory -= it->second->accounted_memory;
+  sessions.erase(it);
+}
+
+void coro_host::data_received(connection_id id, buffer_type buf)
+{
+  auto it = sessions.find(id);
+  if (it == sessions.end())
+  {
+    std::cerr << "cannot find id: " << id << std::endl;
+    return;
+  }
+  it->second->decoder.add_buffer_and_try_decode(std::move(buf));
+  account(*it->second);
+}
+
+void coro_host::on_tick()
+{
+  process_timers();
+}
+
+size_t coro_host::memory_usage() const
+{
+  return hash_map_memory(sessions) + frames.memory_usage() + sessions_memory;
+}
+
+void coro_host::on_socket_readable(SOCKET)
+{
+#ifdef __linux__
+  uint64_t expirations = 0;
+  if (::read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+    std::cerr << "timerfd read: " << last_network_error_message() << std::endl;
+#endif
+  armed = {};
+  process_timers();
+}
+
+coro_session * coro_host::find(connection_id id, uint64_t generation)
+{
+  auto it = sessions.find(id);
+  if (it == sessions.end() || it->second->generation != generation)
+    return nullptr;
+  return it->second.get();
+}
+
+void coro_host::add_timer(coro_session & s, std::chrono::milliseconds after)
+{
+  // Прежний таймер сессии больше не нужен, так что в очереди их не копится больше, чем сессий
+  cancel_timer(s);
+  s.timer = timers.emplace(timer_clock::now() + after, s.id);
+  arm_timer();
+}
+
+void coro_host::cancel_timer(coro_session & s)
+{
+  // timerfd не перевзводим: лишнее срабатывание просто ничего не найдёт
+  if (s.timer.has_value())
+    timers.erase(*std::exchange(s.timer, std::nullopt));
+}
+
+void coro_host::account(coro_session & s)
+{
+  size_t memory = s.memory_usage();
+  sessions_memory += memory;
+  sessions_memory -= std::exchange(s.accounted_memory, memory);
+}
+
+void coro_host::process_timers()
+{
+  auto now = timer_clock::now();
+  // Таймеры закрытых сессий и продолжившихся по другой причине сопрограмм уже сняты
+  while (timers.empty() == false && timers.begin()->first <= now)
+  {
+    auto it = sessions.find(timers.begin()->second);
+    timers.erase(timers.begin());
+    if (it == sessions.end())
+      continue;
+    coro_session & s = *it->second;
+    s.timer.reset();
+    if (s.waiting == coro_session::wait_kind::read || s.waiting == coro_session::wait_kind::sleep)
+    {
+      s.resume_with(nullptr);
+      account(s);
+    }
+  }
+  arm_timer();
+}
+
+void coro_host::arm_timer()
+{
+#ifdef __linux__
+  if (timer_fd < 0 || timers.empty())
+    return;
+  // Перевзводим, только если ближайший таймер раньше уже взведённого
+  auto deadline = timers.begin()->first;
+  if (armed != timer_clock::time_point{} && armed <= deadline)
+    return;
+  armed = deadline;
+
+  // steady_clock на Linux - это CLOCK_MONOTONIC, поэтому время можно передать как абсолютное
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+  itimerspec spec{};
+  spec.it_value.tv_sec = ns / 1000000000;
+  spec.it_value.tv_nsec = ns % 1000000000;
+  // Нулевое значение выключает таймер, поэтому просроченный таймер взводим на ближайшую наносекунду
+  if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+    spec.it_value.tv_nsec = 1;
+  if (::timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr) != 0)
+    std::cerr << "timerfd_settime: " << last_network_error_message() << std::endl;
+#endif
+}
+
+void coro_host::task_done(connection_id id, uint64_t generation, uint64_t token, command result)
+{
+  coro_session * s = find(id, generation);
+  if (s != nullptr && s->wait_token == token && s->waiting == coro_session::wait_kind::task)
+  {
+    s->task_result = std::move(result);
+    s->resume_with(nullptr);
+    account(*s);
+  }
+}
+
+void coro_host::check_finished(coro_session & s)
+{
+  // Соединение закроется в конце итерации цикла, тогда же будет уничтожена и сессия
+  if (s.task.done())
+    owner.close_connection(s.id);
+}
+
+// Ответы собираются в именованных переменных: GCC 12 неверно уничтожает
+//  временные объекты со строками внутри выражения co_await
+session_task dice_session(coro_session & s)
+{
+  // До hello на любую команду отвечаем ошибкой
+  // Если hello не пришёл за handshake_timeout с момента подключения, сессия завершается и соединение закрывается
+  // Срок один на всё рукопожатие: иначе клиент продлевал бы его, присылая что угодно, кроме hello
+  const std::chrono::milliseconds timeout = s.host.get_handshake_timeout();
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  for (bool handshake = false; handshake == false;)
+  {
+    std::chrono::milliseconds remaining{0};
+    if (timeout.count() > 0)
+    {
+      remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+      if (remaining.count() <= 0)
+        co_return;
+    }
+    std::optional<command> cmd = co_await s.read_command(remaining);
+    if (cmd.has_value() == false)
+      co_return;
+    handshake = s.allow_command() && cmd->type == "hello";
+    command to_send;
+    to_send.type = handshake ? "ok" : "error";
+    ROLL_PROBE2(dispatch, s.id, cmd->type.c_str());
+    tracer.on_dispatched(cmd->type);
+    co_await s.send(std::move(to_send));
+  }
+
+  for (;;)
+  {
+    command cmd = co_await s.read_command();
+    command to_send;
+    if (s.allow_command() == false)
+    {
+      to_send.type = "error";
+    }
+    else if (cmd.type == "hello")
+    {
+      to_send.type = "ok";
+    }
+    else if (cmd.type == "roll")
+    {
+      to_send.type = "won";
+      to_send.args.emplace("result", std::to_string(roll_dice()));
+    }
+    else if (cmd.type == "stats")
+    {
+      to_send.type = "stats";
+      s.fill_stats(to_send.args);
+    }
+    else if (cmd.type == "simulate")
+    {
+      uint32_t count = 0;
+      if (client_handler::parse_count(cmd, count) == false)
+      {
+        to_send.type = "error";
+      }
+      else
+      {
+        // Пока задача выполняется, следующие команды копятся в inbox, так что порядок ответов сохраняется
+        uint32_t seed = static_cast<uint32_t>(std::rand());
+        if (count > client_handler::offload_threshold)
+        {
+          tracer.on_offloaded();
+          to_send = co_await s.run_task([count, seed] { return client_handler::make_simulated(count, simulate_rolls(count, seed)); });
+        }
+        else
+          to_send = client_handler::make_simulated(count, simulate_rolls(count, seed));
+      }
+    }
+    else
+    {
+      to_send.type = "error";
+    }
+    ROLL_PROBE2(dispatch, s.id, cmd.type.c_str());
+    tracer.on_dispatched(cmd.type);
+    co_await s.send(std::move(to_send));
+  }
+}
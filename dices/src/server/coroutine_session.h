@@ -0,0 +1,282 @@
+#ifndef COROUTINE_SESSION_H
+#define COROUTINE_SESSION_H
+
+#include "connection_manager.h"
+#include "command_decoder.h"
+#include "admission_control.h"
+#include "frame_pool.h"
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+
+// Сессии на сопрограммах C++20
+// Вместо конечного автомата с флагами(как got_handshake в client_handler) сценарий клиента
+//  пишется как обычная последовательная функция:
+//
+//   session_task dice_session(coro_session & s)
+//   {
+//     auto cmd = co_await s.read_command();
+//     co_await s.send(...);
+//   }
+//
+// Сопрограмма продолжается прямо из цикла менеджера подключений: из декодера, когда пришла команда,
+//  из таймера или из очереди завершений пула потоков, без промежуточных очередей
+// Кадры сопрограмм берутся из frame_pool хоста через promise_type::operator new
+// Когда соединение закрывается, кадр уничтожается в той точке, где сопрограмма ждёт,
+//  деструкторы локальных переменных при этом отрабатывают
+
+class coro_session;
+class coro_host;
+
+// Интерфейс владельца сопрограммных сессий
+struct coro_host_owner
+{
+  virtual ~coro_host_owner() = default;
+  virtual void on_send_command(connection_id id, command cmd) = 0;
+  virtual void fill_stats(command::arguments_type & args) = 0;
+  // Выполняет задачу вне потока ввода-вывода, done вызывается в цикле менеджера подключений
+  // Если пула потоков нет, done вызывается сразу
+  virtual void run_task(std::function<command()> task, std::function<void(command)> done) = 0;
+  virtual void close_connection(connection_id id) = 0;
+};
+
+// Сопрограмма сессии, владеет своим кадром
+// Запускается хостом после создания, завершение сессии закрывает соединение
+class session_task
+{
+public:
+  struct promise_type
+  {
+    session_task get_return_object()
+    {
+      return session_task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception();
+
+    // Единственный параметр сопрограммы - сессия, по ней находится пул хоста
+    static void * operator new(size_t size, coro_session & s);
+    static void operator delete(void * ptr) { frame_pool::deallocate(ptr); }
+  };
+
+  session_task() = default;
+  session_task(session_task && other) noexcept : handle(std::exchange(other.handle, {})) {}
+  session_task & operator=(session_task && other) noexcept
+  {
+    std::swap(handle, other.handle);
+    return *this;
+  }
+  ~session_task()
+  {
+    if (handle)
+      handle.destroy();
+  }
+
+  void start() { handle.resume(); }
+  bool done() const { return handle == nullptr || handle.done(); }
+
+private:
+  explicit session_task(std::coroutine_handle<promise_type> h) : handle(h) {}
+  std::coroutine_handle<promise_type> handle;
+};
+
+// Сессия одного соединения: декодер, входящие команды и то, чего сейчас ждёт сопрограмма
+class coro_session : public command_decoder_user
+{
+public:
+  // Сколько команд может ждать в inbox, пока сопрограмма занята, тот же предел, что и у client_handler
+  // Клиент, который шлёт команды быстрее, чем получает ответы, отключается
+  static constexpr size_t max_inbox = 1024;
+
+  coro_session(coro_host & host, connection_id id, uint64_t generation, uint64_t address_key);
+
+  // Ожидание следующей команды
+  // Ошибка декодирования приходит командой с пустым типом
+  struct read_awaiter
+  {
+    coro_session & s;
+    bool suspended = false;
+
+    bool await_ready() const { return s.inbox.empty() == false; }
+    void await_suspend(std::coroutine_handle<> h);
+    command await_resume();
+  };
+  read_awaiter read_command() { return read_awaiter{*this}; }
+
+  // То же с таймаутом: возвращает nullopt, если команда не пришла вовремя, 0 - ждать без ограничения
+  struct timed_read_awaiter : read_awaiter
+  {
+    std::chrono::milliseconds timeout;
+
+    void await_suspend(std::coroutine_handle<> h);
+    std::optional<command> await_resume();
+  };
+  timed_read_awaiter read_command(std::chrono::milliseconds timeout)
+  {
+    return timed_read_awaiter{{*this}, timeout};
+  }
+
+  // Ответ сразу кладётся в буфер менеджера подключений, поэтому сопрограмма не приостанавливается
+  std::suspend_never send(command cmd);
+
+  struct sleep_awaiter
+  {
+    coro_session & s;
+    std::chrono::milliseconds duration;
+
+    bool await_ready() const { return duration.count() <= 0; }
+    void await_suspend(std::coroutine_handle<> h);
+    void await_resume() {}
+  };
+  sleep_awaiter sleep(std::chrono::milliseconds duration) { return sleep_awaiter{*this, duration}; }
+
+  // Выполняет задачу в пуле потоков, сопрограмма продолжается в цикле менеджера с её результатом
+  struct task_awaiter
+  {
+    coro_session & s;
+    std::function<command()> task;
+
+    bool await_ready() const { return false; }
+    bool await_suspend(std::coroutine_handle<> h);
+    command await_resume() { return std::move(*std::exchange(s.task_result, std::nullopt)); }
+  };
+  task_awaiter run_task(std::function<command()> task) { return task_awaiter{*this, std::move(task)}; }
+
+  // Проверка частоты команд клиента, false - команду выполнять нельзя
+  bool allow_command();
+  void fill_stats(command::arguments_type & args);
+
+  // command_decoder_user interface
+  void on_decoded_command(command cmd) override;
+  void on_decode_error() override;
+
+  size_t memory_usage() const;
+
+  coro_host & host;
+  const connection_id id;
+  const uint64_t generation;
+  const uint64_t address_key;
+
+private:
+  friend class coro_host;
+
+  // Очередь таймеров хоста: срок и сессия, у каждой сессии в очереди не больше одного таймера
+  using timer_queue = std::multimap<std::chrono::steady_clock::time_point, connection_id>;
+
+  // Чего сейчас ждёт сопрограмма
+  enum class wait_kind
+  {
+    none,
+    read,
+    sleep,
+    task
+  };
+
+  command_decoder decoder;
+  token_bucket bucket;
+  // Команды, пришедшие, пока сопрограмма ждала чего-то другого
+  std::deque<command> inbox;
+  wait_kind waiting = wait_kind::none;
+  // Меняется при каждом продолжении, по нему отбрасываются устаревшие результаты задач
+  uint64_t wait_token = 0;
+  // Таймер текущего ожидания, снимается при продолжении сопрограммы
+  std::optional<timer_queue::iterator> timer;
+  // Память сессии, учтённая в coro_host::sessions_memory
+  size_t accounted_memory = 0;
+  // Соединение закрывается за переполнение inbox, остальные команды не обрабатываются
+  bool closing = false;
+  std::coroutine_handle<> suspended;
+  // Команда или результат задачи, с которым продолжается сопрограмма, nullptr - таймаут
+  // Объект живёт у вызывающего resume_with, поэтому команда перемещается только один раз
+  command * incoming = nullptr;
+  // Результат задачи хранится у сессии: без пула потоков он приходит ещё до приостановки
+  std::optional<command> task_result;
+  // Объявлена последней, чтобы кадр уничтожался раньше остальных полей
+  session_task task;
+
+  void suspend(std::coroutine_handle<> h, wait_kind kind);
+  void resume_with(command * value);
+};
+
+// Хост сопрограммных сессий одного цикла менеджера подключений
+// Хранит сессии, пул кадров и таймеры
+// Таймеры ждут в timerfd(Linux), который отслеживается менеджером как сокет,
+//  на других системах они проверяются на тике, то есть с точностью до секунды
+class coro_host : public socket_watcher
+{
+public:
+  explicit coro_host(coro_host_owner & owner);
+  ~coro_host() override;
+
+  [[nodiscard]]
+  bool open_timers(connection_manager & manager);
+  void close_timers();
+
+  void set_admission_control(admission_control * admission) { this->admission = admission; }
+  // Сколько ждать hello, 0 - без ограничения
+  void set_handshake_timeout(std::chrono::milliseconds timeout) { handshake_timeout = timeout; }
+  std::chrono::milliseconds get_handshake_timeout() const { return handshake_timeout; }
+
+  void open(connection_id id, uint64_t address_key);
+  void close(connection_id id);
+  void data_received(connection_id id, buffer_type buf);
+  void on_tick();
+
+  size_t size() const { return sessions.size(); }
+  size_t memory_usage() const;
+  void * allocate_frame(size_t size) { return frames.allocate(size); }
+
+  // socket_watcher interface
+  void on_socket_readable(SOCKET sock) override;
+
+private:
+  friend class coro_session;
+
+  using timer_clock = std::chrono::steady_clock;
+
+  coro_host_owner & owner;
+  admission_control * admission;
+  std::chrono::milliseconds handshake_timeout;
+  // Пул объявлен раньше сессий, чтобы пережить их кадры
+  frame_pool frames;
+  std::unordered_map<connection_id, std::unique_ptr<coro_session>> sessions;
+  uint64_t next_generation;
+  // Память всех сессий, считается при их изменении, чтобы stats не обходил все сессии
+  size_t sessions_memory;
+
+  coro_session::timer_queue timers;
+  connection_manager * manager;
+  int timer_fd;
+  // Момент, на который сейчас взведён timerfd
+  timer_clock::time_point armed;
+
+  coro_session * find(connection_id id, uint64_t generation);
+  void add_timer(coro_session & s, std::chrono::milliseconds after);
+  void cancel_timer(coro_session & s);
+  // Обновляет sessions_memory после того, как сессия приняла данные или продолжилась
+  void account(coro_session & s);
+  void process_timers();
+  void arm_timer();
+  void task_done(connection_id id, uint64_t generation, uint64_t token, command result);
+  // Закрывает соединение, если сопрограмма сессии завершилась
+  void check_finished(coro_session & s);
+};
+
+inline
+void * session_task::promise_type::operator new(size_t size, coro_session & s)
+{
+  return s.host.allocate_frame(size);
+}
+
+// Сценарий игры в кости, тот же протокол, что и у client_handler
+session_task dice_session(coro_session & s);
+
+#endif // COROUTINE_SESSION_H
@@ -0,0 +1,40 @@
+#ifndef DICE_H
+#define DICE_H
+
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+
+// Бросок одной игральной кости, возвращает число от 1 до 6
+// Используется и TCP-обработчиком, и UDP-сервисом, чтобы логика игры была в одном месте
+inline
+int roll_dice()
+{
+  return 1 + std::rand() % 6;
+}
+
+// Итог серии бросков: сумма и сколько раз выпала каждая грань
+struct roll_series
+{
+  uint64_t sum = 0;
+  std::array<uint64_t, 6> faces{};
+};
+
+// Моделирует серию из count бросков
+// Использует свой генератор, а не общий std::rand, поэтому может выполняться в пуле потоков
+// Зерно выбирается в потоке ввода-вывода, так что при фиксированном --seed результат воспроизводим
+inline
+roll_series simulate_rolls(uint32_t count, uint32_t seed)
+{
+  std::minstd_rand gen(seed);
+  std::uniform_int_distribution<int> dist(0, 5);
+  roll_series ret;
+  for (uint32_t i = 0; i < count; ++i)
+    ++ret.faces[dist(gen)];
+  for (size_t face = 0; face < ret.faces.size(); ++face)
+    ret.sum += ret.faces[face] * (face + 1);
+  return ret;
+}
+
+#endif // DICE_H
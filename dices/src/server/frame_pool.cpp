@@ -0,0 +1,56 @@
+#include "frame_pool.h"
+#include <new>
+
+frame_pool::~frame_pool()
+{
+  for (free_block * head : free_lists)
+  {
+    while (head != nullptr)
+    {
+      free_block * next = head->next;
+      ::operator delete(reinterpret_cast<header *>(head) - 1);
+      head = next;
+    }
+  }
+}
+
+void * frame_pool::allocate(size_t size)
+{
+  // Большие кадры не кэшируем, size_class за пределами списков означает обычную кучу
+  size_t size_class = size == 0 ? 0 : (size - 1) / granularity;
+  header * hdr = nullptr;
+  if (size_class < free_lists.size() && free_lists[size_class] != nullptr)
+  {
+    free_block * block = free_lists[size_class];
+    free_lists[size_class] = block->next;
+    hdr = reinterpret_cast<header *>(block) - 1;
+  }
+  else
+  {
+    size_t bytes = size_class < free_lists.size() ? block_size(size_class) : sizeof(header) + size;
+    hdr = static_cast<header *>(::operator new(bytes));
+    if (size_class < free_lists.size())
+      reserved_bytes += bytes;
+  }
+
+  hdr->pool = this;
+  hdr->size_class = size_class;
+  ++allocated;
+  return hdr + 1;
+}
+
+void frame_pool::deallocate(void * ptr)
+{
+  header * hdr = static_cast<header *>(ptr) - 1;
+  frame_pool * pool = hdr->pool;
+  --pool->allocated;
+  if (hdr->size_class >= pool->free_lists.size())
+  {
+    ::operator delete(hdr);
+    return;
+  }
+
+  free_block * block = static_cast<free_block *>(ptr);
+  block->next = pool->free_lists[hdr->size_class];
+  pool->free_lists[hdr->size_class] = block;
+}
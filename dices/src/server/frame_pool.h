@@ -0,0 +1,58 @@
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <array>
+#include <cstddef>
+
+// Пул памяти для кадров сопрограмм сессий
+// Кадры одной и той же сопрограммы всегда одного размера, поэтому память раздаётся
+//  из списков свободных блоков по классам размеров с шагом granularity
+// Освобождённый блок возвращается в свой список и сразу же достаётся следующей сессии,
+//  так что при постоянном числе соединений malloc не вызывается вовсе
+// Пул однопоточный: один на цикл менеджера подключений
+// Перед каждым блоком лежит заголовок с указателем на пул, поэтому освобождать блок
+//  можно без ссылки на пул(operator delete у promise_type её не получает)
+class frame_pool
+{
+public:
+  static constexpr size_t granularity = 64;
+  // Кадры больше этого размера берутся из обычной кучи
+  static constexpr size_t max_pooled_size = 2048;
+
+  frame_pool() = default;
+  // Все кадры к этому моменту должны быть уничтожены
+  ~frame_pool();
+
+  frame_pool(const frame_pool &) = delete;
+  frame_pool & operator=(const frame_pool &) = delete;
+
+  void * allocate(size_t size);
+  static void deallocate(void * ptr);
+
+  // Память, занятая пулом, включая свободные блоки
+  size_t memory_usage() const { return reserved_bytes; }
+  size_t allocated_count() const { return allocated; }
+
+private:
+  struct alignas(std::max_align_t) header
+  {
+    frame_pool * pool;
+    size_t size_class;
+  };
+
+  struct free_block
+  {
+    free_block * next;
+  };
+
+  std::array<free_block *, max_pooled_size / granularity> free_lists{};
+  size_t reserved_bytes = 0;
+  size_t allocated = 0;
+
+  static size_t block_size(size_t size_class)
+  {
+    return sizeof(header) + (size_class + 1) * granularity;
+  }
+};
+
+#endif // FRAME_POOL_H
@@ -0,0 +1,45 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <atomic>
+#include <string>
+
+// Уровни логирования, сообщения ниже текущего уровня не печатаются
+// Ошибки печатаются всегда, поэтому уровень error оставляет только их
+// Сообщения на каждый запрос имеют уровень debug: при большой нагрузке вывод в консоль
+//  стоит дороже самой обработки
+enum class log_level
+{
+  debug = 0,
+  info = 1,
+  warning = 2,
+  error = 3
+};
+
+// Текущий уровень, может меняться на лету при перечитывании конфигурации
+inline std::atomic<log_level> current_log_level{log_level::info};
+
+inline
+bool log_enabled(log_level level)
+{
+  return level >= current_log_level.load(std::memory_order_relaxed);
+}
+
+// Разбирает название уровня, возвращает false, если такого уровня нет
+inline
+bool parse_log_level(const std::string & str, log_level & out)
+{
+  if (str == "debug")
+    out = log_level::debug;
+  else if (str == "info")
+    out = log_level::info;
+  else if (str == "warning")
+    out = log_level::warning;
+  else if (str == "error")
+    out = log_level::error;
+  else
+    return false;
+  return true;
+}
+
+#endif // LOGGER_H
@@ -1,14 +1,151 @@
 #include <iostream>
+#include <csignal>
 #include "application.h"
 
+namespace
+{
+
+application * running_app = nullptr;
+
+// По сигналу завершения аккуратно останавливаем сервер, чтобы дописать захват и закрыть сокеты
+void handle_stop_signal(int)
+{
+  if (running_app != nullptr)
+    running_app->conn_manager.stop();
+}
+
+// По SIGHUP перечитываем конфигурацию, сами изменения применяются в цикле сервера
+void handle_reload_signal(int)
+{
+  if (running_app != nullptr)
+    running_app->request_reload();
+}
+
+// По SIGUSR1 выгружаем трассировку запросов
+void handle_trace_signal(int)
+{
+  if (running_app != nullptr)
+    running_app->request_trace_dump();
+}
+
+void print_usage(const char * name)
+{
+  std::cerr << "Usage: " << name << " [options] [address] [address...]" << std::endl
+            << "   or: " << name << " [options] [server ip] [server port]" << std::endl
+            << "Address formats: 0.0.0.0:35555, [::]:35555, unix:/tmp/roll.sock" << std::endl
+            << "UDP service: udp:0.0.0.0:35555, udp:[::]:35555" << std::endl
+            << "TLS (needs --tls-cert and --tls-key): tls:0.0.0.0:35443, tls:[::]:35443" << std::endl
+            << "Options:" << std::endl
+            << "  --config=FILE   read options from FILE, reread it on SIGHUP" << std::endl
+            << "  --seed=N        fixed random seed" << std::endl
+            << "  --capture=FILE  record incoming traffic for roll_replay" << std::endl
+            << "  --spin-us=N     poll sockets without sleeping for N microseconds" << std::endl
+            << "  --busy-poll-us=N  set SO_BUSY_POLL on sockets (Linux)" << std::endl
+            << "  --cpu=N         pin the event loop to cpu N (Linux)" << std::endl
+            << "  --unlimited     disable connection and rate limits, for benchmarks" << std::endl
+            << "  --trace-sample=N  trace every N-th request, dump on SIGUSR1 to --trace-file" << std::endl
+            << "  --KEY=VALUE     any other config file option, '-' may be used instead of '_'" << std::endl;
+}
+
+}
+
 int main(int argc, char ** argv)
 {
-  if (argc < 3)
+  std::string config_path;
+  std::vector<std::string> args;
+  config_overrides overrides;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    if (arg.compare(0, 2, "--") != 0)
+    {
+      args.push_back(std::move(arg));
+      continue;
+    }
+
+    // --some-key=value превращается в пару some_key и value
+    auto eq = arg.find('=');
+    std::string key = arg.substr(2, eq == arg.npos ? arg.npos : eq - 2);
+    std::string value = eq == arg.npos ? "" : arg.substr(eq + 1);
+    for (char & c : key)
+    {
+      if (c == '-')
+        c = '_';
+    }
+
+    if (key == "config")
+      config_path = value;
+    else if (key == "unlimited")
+      overrides.emplace_back("limits", "off");
+    else
+      overrides.emplace_back(key, value);
+  }
+
+  if (args.empty() && config_path.empty())
+  {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  net_address address;
+  // Старый формат запуска: IP-адрес и порт отдельными аргументами
+  // Второй аргумент в нём - число, иначе это два адреса, например "udp:..." и "0.0.0.0:35555"
+  if (args.size() == 2 && net_address::parse(args[0], address) == false &&
+      args[1].find_first_not_of("0123456789") == args[1].npos)
+  {
+    // Порт 0 здесь скорее опечатка, чем просьба выбрать любой свободный порт
+    const std::string & port = args[1];
+    if (port.empty() || port.size() > 5 || std::stoul(port) == 0 || std::stoul(port) > 65535)
+    {
+      std::cerr << "Invalid port: " << port << ", expected 1-65535" << std::endl;
+      return EXIT_FAILURE;
+    }
+    overrides.emplace_back("listen", args[0] + ":" + port);
+  }
+  else
+  {
+    const std::string udp_prefix = "udp:";
+    const std::string tls_prefix = "tls:";
+    for (std::string arg : args)
+    {
+      std::string key = "listen";
+      if (arg.compare(0, udp_prefix.size(), udp_prefix) == 0)
+      {
+        key = "udp";
+        arg.erase(0, udp_prefix.size());
+      }
+      else if (arg.compare(0, tls_prefix.size(), tls_prefix) == 0)
+      {
+        key = "tls_listen";
+        arg.erase(0, tls_prefix.size());
+      }
+      overrides.emplace_back(key, arg);
+    }
+  }
+
+  server_config cfg;
+  if (build_config(config_path, overrides, cfg) == false)
   {
-    std::cerr << "Usage: " << argv[0] << " [server ip] [server port]" << std::endl;
+    print_usage(argv[0]);
     return EXIT_FAILURE;
   }
 
   application app;
-  return app.run(argv[1], std::stoi(argv[2]));
+  running_app = &app;
+  std::signal(SIGINT, handle_stop_signal);
+  std::signal(SIGTERM, handle_stop_signal);
+#ifdef SIGHUP
+  std::signal(SIGHUP, handle_reload_signal);
+#endif
+#ifdef SIGUSR1
+  std::signal(SIGUSR1, handle_trace_signal);
+#endif
+#ifdef SIGPIPE
+  // Запись в сокет, закрытый клиентом, должна вернуть ошибку, а не завершить процесс
+  // OpenSSL пишет в сокет через write, где флаг MSG_NOSIGNAL не передать
+  std::signal(SIGPIPE, SIG_IGN);
+#endif
+  int ret = app.run(cfg, config_path, overrides);
+  running_app = nullptr;
+  return ret;
 }
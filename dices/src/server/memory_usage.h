@@ -0,0 +1,29 @@
+#ifndef MEMORY_USAGE_H
+#define MEMORY_USAGE_H
+
+#include <cstddef>
+
+// Функции для оценки памяти, занимаемой контейнерами
+// Оценка не точная: учитываются размеры узлов, массивов корзин и выделенных буферов,
+//  а служебные данные аллокатора принимаются равными allocation_overhead на каждое выделение
+
+// Служебные данные malloc на одно выделение памяти(glibc на 64-битных системах)
+constexpr size_t allocation_overhead = 16;
+
+// Память, занимаемая блоком в куче заданной ёмкости
+inline
+size_t heap_block_size(size_t capacity)
+{
+  return capacity == 0 ? 0 : capacity + allocation_overhead;
+}
+
+// Память узлов и массива корзин std::unordered_map(без того, на что ссылаются значения)
+// Узел содержит значение и указатель на следующий узел
+template<class Map>
+size_t hash_map_memory(const Map & map)
+{
+  size_t node_size = sizeof(typename Map::value_type) + sizeof(void *);
+  return map.size() * heap_block_size(node_size) + heap_block_size(map.bucket_count() * sizeof(void *));
+}
+
+#endif // MEMORY_USAGE_H
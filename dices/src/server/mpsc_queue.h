@@ -0,0 +1,102 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <atomic>
+#include <utility>
+
+// Неблокирующая очередь со многими писателями и одним читателем(алгоритм Дмитрия Вьюкова)
+// push можно вызывать из любого потока, pop - только из одного
+// Писатель делает один атомарный обмен, читатель вообще не использует атомарные операции чтения-записи
+// Особенность алгоритма: пока писатель между обменом и связыванием узла, читатель видит очередь пустой,
+//  для этого есть maybe_not_empty, чтобы читатель мог проверить это и прийти позже
+template<class T>
+class mpsc_queue
+{
+public:
+  mpsc_queue() :
+    head(&stub),
+    tail(&stub)
+  {
+    stub.next.store(nullptr, std::memory_order_relaxed);
+  }
+
+  ~mpsc_queue()
+  {
+    T tmp;
+    while (pop(tmp))
+    {}
+  }
+
+  mpsc_queue(const mpsc_queue &) = delete;
+  mpsc_queue & operator=(const mpsc_queue &) = delete;
+
+  void push(T value)
+  {
+    node * n = new node;
+    n->value = std::move(value);
+    push_node(n);
+  }
+
+  // Возвращает false, если очередь пуста(или писатель ещё не закончил добавление)
+  bool pop(T & out)
+  {
+    node * t = tail;
+    node * next = t->next.load(std::memory_order_acquire);
+    // Пропускаем заглушку
+    if (t == &stub)
+    {
+      if (next == nullptr)
+        return false;
+      tail = next;
+      t = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next != nullptr)
+    {
+      tail = next;
+      out = std::move(t->value);
+      delete t;
+      return true;
+    }
+
+    // t - последний узел, возвращаем заглушку в конец, чтобы его можно было забрать
+    if (t != head.load(std::memory_order_acquire))
+      return false;
+    push_node(&stub);
+    next = t->next.load(std::memory_order_acquire);
+    if (next == nullptr)
+      return false;
+    tail = next;
+    out = std::move(t->value);
+    delete t;
+    return true;
+  }
+
+  // true, если в очереди есть узлы, в том числе ещё не до конца добавленные
+  // Вызывается только читателем
+  bool maybe_not_empty() const
+  {
+    return tail != head.load(std::memory_order_acquire) || tail->next.load(std::memory_order_acquire) != nullptr;
+  }
+
+private:
+  struct node
+  {
+    std::atomic<node *> next{nullptr};
+    T value;
+  };
+
+  std::atomic<node *> head;
+  node * tail;
+  node stub;
+
+  void push_node(node * n)
+  {
+    n->next.store(nullptr, std::memory_order_relaxed);
+    node * prev = head.exchange(n, std::memory_order_acq_rel);
+    prev->next.store(n, std::memory_order_release);
+  }
+};
+
+#endif // MPSC_QUEUE_H
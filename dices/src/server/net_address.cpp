@@ -0,0 +1,192 @@
+#include "net_address.h"
+#include <cstddef>
+
+namespace
+{
+
+constexpr std::string_view unix_prefix = "unix:";
+
+// Разбирает порт, возвращает false, если строка не является числом от 0 до 65535
+bool parse_port(const std::string & str, uint16_t & port)
+{
+  if (str.empty() || str.size() > 5)
+    return false;
+  uint32_t val = 0;
+  for (char c : str)
+  {
+    if (c < '0' || c > '9')
+      return false;
+    val = val * 10 + (c - '0');
+  }
+  if (val > 0xFFFF)
+    return false;
+  port = static_cast<uint16_t>(val);
+  return true;
+}
+
+}
+
+net_address::net_address() :
+  length(0)
+{
+  ::memset(&storage, 0, sizeof(storage));
+  storage.ss_family = AF_UNSPEC;
+}
+
+bool net_address::parse(const std::string & str, net_address & out)
+{
+  net_address ret;
+
+  // unix:/path/to/socket
+  if (str.compare(0, unix_prefix.size(), unix_prefix) == 0)
+  {
+    std::string path = str.substr(unix_prefix.size());
+    auto & un = reinterpret_cast<sockaddr_un &>(ret.storage);
+    // Путь должен поместиться вместе с завершающим нулём
+    if (path.empty() || path.size() >= sizeof(un.sun_path))
+      return false;
+    un.sun_family = AF_UNIX;
+    ::memcpy(un.sun_path, path.data(), path.size());
+    ret.length = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path.size() + 1);
+    out = ret;
+    return true;
+  }
+
+  // [ipv6]:port
+  if (str.empty() == false && str.front() == '[')
+  {
+    auto end = str.find("]:");
+    if (end == str.npos)
+      return false;
+    uint16_t port = 0;
+    if (parse_port(str.substr(end + 2), port) == false)
+      return false;
+    auto & in6 = reinterpret_cast<sockaddr_in6 &>(ret.storage);
+    in6.sin6_family = AF_INET6;
+    in6.sin6_port = htons(port);
+    std::string ip = str.substr(1, end - 1);
+    if (::inet_pton(AF_INET6, ip.c_str(), &in6.sin6_addr) != 1)
+      return false;
+    ret.length = sizeof(sockaddr_in6);
+    out = ret;
+    return true;
+  }
+
+  // ipv4:port
+  auto sep = str.rfind(':');
+  if (sep == str.npos)
+    return false;
+  uint16_t port = 0;
+  if (parse_port(str.substr(sep + 1), port) == false)
+    return false;
+  return from_ip_port(str.substr(0, sep), port, out);
+}
+
+bool net_address::from_ip_port(const std::string & ip, uint16_t port, net_address & out)
+{
+  net_address ret;
+  auto & in = reinterpret_cast<sockaddr_in &>(ret.storage);
+  in.sin_family = AF_INET;
+  in.sin_port = htons(port);
+  if (::inet_pton(AF_INET, ip.c_str(), &in.sin_addr) != 1)
+    return false;
+  ret.length = sizeof(sockaddr_in);
+  out = ret;
+  return true;
+}
+
+compact_address net_address::compact() const
+{
+  compact_address ret;
+  ::memset(&ret, 0, sizeof(ret));
+  ret.family = static_cast<uint8_t>(family());
+  if (family() == AF_INET)
+  {
+    const auto & in = reinterpret_cast<const sockaddr_in &>(storage);
+    ::memcpy(ret.ip, &in.sin_addr, sizeof(in.sin_addr));
+    ret.port = in.sin_port;
+  }
+  else if (family() == AF_INET6)
+  {
+    const auto & in6 = reinterpret_cast<const sockaddr_in6 &>(storage);
+    ::memcpy(ret.ip, &in6.sin6_addr, sizeof(in6.sin6_addr));
+    ret.port = in6.sin6_port;
+  }
+  return ret;
+}
+
+net_address net_address::from_compact(const compact_address & addr)
+{
+  net_address ret;
+  if (addr.family == AF_INET)
+  {
+    auto & in = reinterpret_cast<sockaddr_in &>(ret.storage);
+    in.sin_family = AF_INET;
+    ::memcpy(&in.sin_addr, addr.ip, sizeof(in.sin_addr));
+    in.sin_port = addr.port;
+    ret.length = sizeof(sockaddr_in);
+  }
+  else if (addr.family == AF_INET6)
+  {
+    auto & in6 = reinterpret_cast<sockaddr_in6 &>(ret.storage);
+    in6.sin6_family = AF_INET6;
+    ::memcpy(&in6.sin6_addr, addr.ip, sizeof(in6.sin6_addr));
+    in6.sin6_port = addr.port;
+    ret.length = sizeof(sockaddr_in6);
+  }
+  else if (addr.family == AF_UNIX)
+  {
+    // Путь неизвестен, получается безымянный Unix-адрес
+    ret.storage.ss_family = AF_UNIX;
+    ret.length = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path));
+  }
+  return ret;
+}
+
+int net_address::family() const
+{
+  return storage.ss_family;
+}
+
+std::string net_address::local_path() const
+{
+  if (family() != AF_UNIX)
+    return {};
+  const auto & un = reinterpret_cast<const sockaddr_un &>(storage);
+  // Адрес принятого соединения обычно безымянный, тогда длина равна размеру sun_family
+  if (length <= offsetof(sockaddr_un, sun_path))
+    return {};
+  size_t max_len = length - offsetof(sockaddr_un, sun_path);
+  return std::string(un.sun_path, ::strnlen(un.sun_path, max_len));
+}
+
+// Функция преобразовывает адрес в строку в формате, который понимает parse
+std::string net_address::to_string() const
+{
+  char buf[INET6_ADDRSTRLEN] = {0};
+  switch (family())
+  {
+  case AF_INET:
+  {
+    const auto & in = reinterpret_cast<const sockaddr_in &>(storage);
+    ::inet_ntop(AF_INET, &in.sin_addr, buf, sizeof(buf));
+    return std::string(buf) + ":" + std::to_string(ntohs(in.sin_port));
+  }
+  case AF_INET6:
+  {
+    const auto & in6 = reinterpret_cast<const sockaddr_in6 &>(storage);
+    ::inet_ntop(AF_INET6, &in6.sin6_addr, buf, sizeof(buf));
+    return "[" + std::string(buf) + "]:" + std::to_string(ntohs(in6.sin6_port));
+  }
+  case AF_UNIX:
+    return std::string(unix_prefix) + local_path();
+  default:
+    return "unknown";
+  }
+}
+
+bool operator==(const net_address & lhs, const net_address & rhs)
+{
+  return lhs.length == rhs.length &&
+         ::memcmp(&lhs.storage, &rhs.storage, lhs.length) == 0;
+}
@@ -0,0 +1,64 @@
+#ifndef NET_ADDRESS_H
+#define NET_ADDRESS_H
+
+#include "network_utils.h"
+#include <string>
+
+// Компактное представление адреса для хранения в каждом соединении: 20 байт вместо sockaddr_storage
+// Путь Unix-сокета не хранится, его нужно восстанавливать, например, по адресу слушателя
+struct compact_address
+{
+  uint8_t ip[16];
+  // Порт в сетевом порядке байт
+  uint16_t port;
+  uint8_t family;
+};
+
+// Абстракция сетевого адреса
+// Хранит внутри sockaddr_storage, поэтому может содержать IPv4, IPv6 или путь Unix-сокета
+// Строковое представление:
+//  - IPv4: 127.0.0.1:35555
+//  - IPv6: [::1]:35555
+//  - Unix: unix:/tmp/roll.sock
+class net_address
+{
+public:
+  net_address();
+
+  // Разбирает строку в адрес, возвращает false, если строка имеет неверный формат
+  [[nodiscard]]
+  static bool parse(const std::string & str, net_address & out);
+  // Создаёт адрес из IPv4-адреса и порта(старый формат запуска сервера)
+  [[nodiscard]]
+  static bool from_ip_port(const std::string & ip, uint16_t port, net_address & out);
+
+  // Преобразование в компактный вид и обратно
+  compact_address compact() const;
+  static net_address from_compact(const compact_address & addr);
+
+  // Семейство адреса: AF_INET, AF_INET6, AF_UNIX или AF_UNSPEC, если адрес пуст
+  int family() const;
+  bool empty() const { return family() == AF_UNSPEC; }
+
+  // Доступ к сырой структуре для передачи в bind/accept/connect
+  const sockaddr * data() const { return reinterpret_cast<const sockaddr *>(&storage); }
+  sockaddr * data() { return reinterpret_cast<sockaddr *>(&storage); }
+  socklen_t size() const { return length; }
+  // Перед вызовом accept/recvfrom нужно передавать capacity, а после - выставить длину
+  static constexpr socklen_t capacity() { return sizeof(sockaddr_storage); }
+  void set_size(socklen_t len) { length = len; }
+
+  // Путь Unix-сокета, для остальных семейств пустая строка
+  std::string local_path() const;
+
+  std::string to_string() const;
+
+  friend bool operator==(const net_address & lhs, const net_address & rhs);
+  friend bool operator!=(const net_address & lhs, const net_address & rhs) { return !(lhs == rhs); }
+
+private:
+  sockaddr_storage storage;
+  socklen_t length;
+};
+
+#endif // NET_ADDRESS_H
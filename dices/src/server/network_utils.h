@@ -13,6 +13,9 @@
 
 #ifdef WIN32
 
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <afunix.h>
 #include <windows.h>
 
 inline
@@ -36,7 +39,9 @@ std::string_view last_network_error_message()
 enum
 {
   NetWouldBlock = WSAEWOULDBLOCK,
-  NetAgain = WSAEWOULDBLOCK
+  NetAgain = WSAEWOULDBLOCK,
+  NetInterrupted = WSAEINTR,
+  NetConnectionRefused = WSAECONNREFUSED
 };
 
 inline
@@ -46,18 +51,31 @@ using socklen_t = int;
 
 #else
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <cstring>
 #include <cerrno>
 
+// Старые заголовки glibc не знают об опциях активного ожидания
+#if defined(__linux__) && !defined(SO_BUSY_POLL)
+#define SO_BUSY_POLL 46
+#endif
+#if defined(__linux__) && !defined(SO_PREFER_BUSY_POLL)
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
 constexpr static int SOCKET_ERROR = -1;
 constexpr static int INVALID_SOCKET = -1;
 
 enum
 {
   NetWouldBlock = EWOULDBLOCK,
-  NetAgain = EAGAIN
+  NetAgain = EAGAIN,
+  NetInterrupted = EINTR,
+  NetConnectionRefused = ECONNREFUSED
 };
 
 using SOCKET = int;
@@ -0,0 +1,35 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// Статические точки трассировки(USDT) на пути запроса, провайдер roll
+// Пока к точке никто не подключился, она стоит одну инструкцию nop
+// Подключиться можно, например, так:
+//  bpftrace -e 'usdt:./roll_srv:roll:read { @bytes = hist(arg1); }'
+//
+// Точки и аргументы:
+//  accept(fd)                   - принято новое соединение
+//  read(fd, bytes)              - данные приняты и отдаются пользователю
+//  decode(length)               - декодирована команда
+//  dispatch(fd, type)           - обработчик выполнил команду, type - строка с её названием
+//  queue(fd, bytes)             - ответ добавлен в буфер на отправку
+//  write(fd, bytes, remaining)  - из буфера отправлено bytes байт, remaining ещё ждут
+//
+// Нужен заголовок sys/sdt.h(пакет systemtap-sdt-dev), без него и с ROLL_USDT=OFF точки пустые
+#if defined(ROLL_ENABLE_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define ROLL_HAS_USDT 1
+#endif
+#endif
+
+#ifdef ROLL_HAS_USDT
+#define ROLL_PROBE1(name, a1) DTRACE_PROBE1(roll, name, a1)
+#define ROLL_PROBE2(name, a1, a2) DTRACE_PROBE2(roll, name, a1, a2)
+#define ROLL_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(roll, name, a1, a2, a3)
+#else
+#define ROLL_PROBE1(name, a1) do {} while (false)
+#define ROLL_PROBE2(name, a1, a2) do {} while (false)
+#define ROLL_PROBE3(name, a1, a2, a3) do {} while (false)
+#endif
+
+#endif // PROBES_H
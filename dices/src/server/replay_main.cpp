@@ -0,0 +1,288 @@
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <unordered_map>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include "application.h"
+#include "command_encoder.h"
+
+// Инструмент воспроизведения захвата трафика, записанного сервером с опцией --capture
+// Два режима:
+//  - внутри процесса: записи подаются прямо в application, без сокетов,
+//    ответы кодируются и сворачиваются в контрольную сумму, которая при фиксированном зерне
+//    должна совпадать от запуска к запуску;
+//  - через сокеты: для каждого соединения из захвата открывается соединение с работающим сервером,
+//    данные посылаются теми же кусками, с исходной скоростью(1x) или максимально быстро
+
+namespace
+{
+
+using replay_clock = std::chrono::steady_clock;
+
+// Приложение, которое вместо посылки в сеть считает ответы
+class replay_application : public application
+{
+public:
+  void on_send_command(connection_id, command cmd) override
+  {
+    buf.clear();
+    if (command_encoder::encode(cmd, buf) == false)
+      return;
+    ++responses;
+    // FNV-1a по всем байтам ответов
+    for (uint8_t b : buf)
+    {
+      digest ^= b;
+      digest *= 0x100000001b3ULL;
+    }
+  }
+
+  buffer_type buf;
+  uint64_t responses = 0;
+  uint64_t digest = 0xcbf29ce484222325ULL;
+};
+
+struct replay_result
+{
+  uint64_t records = 0;
+  uint64_t bytes_sent = 0;
+  uint64_t bytes_received = 0;
+  uint64_t responses = 0;
+  replay_clock::duration elapsed{};
+};
+
+void print_result(std::ostream & out, const replay_result & res)
+{
+  double sec = std::chrono::duration<double>(res.elapsed).count();
+  out << "records: " << res.records << std::endl
+      << "bytes sent: " << res.bytes_sent << std::endl
+      << "bytes received: " << res.bytes_received << std::endl
+      << "responses: " << res.responses << std::endl
+      << "elapsed: " << sec * 1000 << " ms" << std::endl;
+  if (res.records != 0 && sec > 0)
+    out << "ns per record: " << sec * 1e9 / res.records << std::endl
+        << "records per second: " << res.records / sec << std::endl;
+}
+
+int replay_in_process(const std::string & path, unsigned seed, int repeat, bool coroutines)
+{
+  // Сервер много пишет в std::cout, в замерах это не нужно
+  std::ostream out(std::cout.rdbuf());
+  std::cout.rdbuf(nullptr);
+
+  for (int iteration = 0; iteration < repeat; ++iteration)
+  {
+    capture_reader reader;
+    if (reader.open(path) == false)
+      return EXIT_FAILURE;
+
+    // Записи читаются заранее, чтобы не мерить чтение файла
+    std::vector<capture_record> records;
+    capture_record rec;
+    while (reader.next(rec))
+      records.push_back(rec);
+
+    replay_application app;
+    app.set_seed(seed);
+    app.set_coroutine_sessions(coroutines);
+    // Ограничения частоты зависят от реального времени, поэтому снимаем их ради воспроизводимости
+    admission_limits unlimited;
+    unlimited.max_connections = SIZE_MAX;
+    unlimited.max_connections_per_address = UINT32_MAX;
+    unlimited.connection_rate = unlimited.connection_burst = 1e9f;
+    unlimited.address_rate = unlimited.address_burst = 1e9f;
+    app.admission.set_limits(unlimited);
+
+    replay_result res;
+    auto started = replay_clock::now();
+    for (auto & r : records)
+    {
+      connection_id id = static_cast<connection_id>(r.connection);
+      switch (r.type)
+      {
+      case capture_record_type::open:
+        app.on_connection(id);
+        break;
+      case capture_record_type::data:
+        res.bytes_sent += r.data.size();
+        app.on_connection_read(id, std::move(r.data));
+        break;
+      case capture_record_type::close:
+        app.on_connection_closed(id);
+        break;
+      }
+      ++res.records;
+    }
+    res.elapsed = replay_clock::now() - started;
+    res.responses = app.responses;
+
+    out << "iteration " << iteration + 1 << std::endl;
+    print_result(out, res);
+    out << "digest: " << std::hex << app.digest << std::dec << std::endl;
+  }
+
+  std::cout.rdbuf(out.rdbuf());
+  return EXIT_SUCCESS;
+}
+
+// Вычитывает всё, что есть в сокете, возвращает false, если сервер закрыл соединение
+bool drain(SOCKET sock, replay_result & res)
+{
+  uint8_t buf[4096];
+  for (;;)
+  {
+    ssize_t n = ::recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n > 0)
+    {
+      res.bytes_received += n;
+      continue;
+    }
+    if (n < 0 && (net_error() == NetWouldBlock || net_error() == NetAgain))
+      return true;
+    return false;
+  }
+}
+
+int replay_loopback(const std::string & path, const net_address & target, bool realtime)
+{
+  capture_reader reader;
+  if (reader.open(path) == false)
+    return EXIT_FAILURE;
+
+  std::unordered_map<uint32_t, SOCKET> socks;
+  std::vector<SOCKET> closing;
+  replay_result res;
+  capture_record rec;
+  auto started = replay_clock::now();
+
+  while (reader.next(rec))
+  {
+    ++res.records;
+    if (realtime)
+      std::this_thread::sleep_until(started + std::chrono::nanoseconds(rec.timestamp_ns));
+
+    if (rec.type == capture_record_type::open)
+    {
+      SOCKET sock = ::socket(target.family(), SOCK_STREAM, 0);
+      if (sock == INVALID_SOCKET || ::connect(sock, target.data(), target.size()) == SOCKET_ERROR)
+      {
+        std::cerr << "connect to " << target.to_string() << ": " << last_network_error_message() << std::endl;
+        return EXIT_FAILURE;
+      }
+      // Каждый кусок должен уйти отдельно, как в захвате
+      int on = 1;
+      if (target.family() != AF_UNIX)
+        ::setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      socks[rec.connection] = sock;
+      continue;
+    }
+
+    auto it = socks.find(rec.connection);
+    if (it == socks.end())
+      continue;
+    SOCKET sock = it->second;
+
+    if (rec.type == capture_record_type::close)
+    {
+      ::shutdown(sock, SHUT_WR);
+      closing.push_back(sock);
+      socks.erase(it);
+      continue;
+    }
+
+    // Посылаем кусок целиком, вычитывая ответы, чтобы сервер не упёрся в переполненный буфер
+    size_t offset = 0;
+    while (offset < rec.data.size())
+    {
+      ssize_t n = ::send(sock, rec.data.data() + offset, rec.data.size() - offset, MSG_DONTWAIT);
+      if (n > 0)
+      {
+        offset += n;
+        continue;
+      }
+      if (n < 0 && net_error() != NetWouldBlock && net_error() != NetAgain)
+      {
+        std::cerr << "send: " << last_network_error_message() << std::endl;
+        return EXIT_FAILURE;
+      }
+      drain(sock, res);
+      pollfd pfd{sock, POLLOUT, 0};
+      ::poll(&pfd, 1, 100);
+    }
+    res.bytes_sent += rec.data.size();
+    drain(sock, res);
+  }
+
+  // Закрываем оставшиеся соединения и дожидаемся всех ответов
+  for (auto & [conn, sock] : socks)
+  {
+    ::shutdown(sock, SHUT_WR);
+    closing.push_back(sock);
+  }
+  for (SOCKET sock : closing)
+  {
+    pollfd pfd{sock, POLLIN, 0};
+    while (drain(sock, res) && ::poll(&pfd, 1, 5000) > 0)
+    {}
+    ::closesocket(sock);
+  }
+  res.elapsed = replay_clock::now() - started;
+
+  print_result(std::cout, res);
+  return EXIT_SUCCESS;
+}
+
+void print_usage(const char * name)
+{
+  std::cerr << "Usage: " << name << " [capture file] [options]" << std::endl
+            << "Options:" << std::endl
+            << "  --seed=N         random seed for in-process replay, default 1" << std::endl
+            << "  --repeat=N       repeat in-process replay N times" << std::endl
+            << "  --session-api=callback|coroutine  in-process session implementation" << std::endl
+            << "  --target=ADDR    replay over sockets to a running server" << std::endl
+            << "  --speed=max|1x   socket replay speed, default max" << std::endl;
+}
+
+}
+
+int main(int argc, char ** argv)
+{
+  if (argc < 2)
+  {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::string path = argv[1];
+  unsigned seed = 1;
+  int repeat = 1;
+  bool realtime = false;
+  bool coroutines = false;
+  net_address target;
+  for (int i = 2; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    if (arg.compare(0, 7, "--seed=") == 0)
+      seed = static_cast<unsigned>(std::stoul(arg.substr(7)));
+    else if (arg.compare(0, 9, "--repeat=") == 0)
+      repeat = std::stoi(arg.substr(9));
+    else if (arg == "--session-api=callback" || arg == "--session-api=coroutine")
+      coroutines = arg == "--session-api=coroutine";
+    else if (arg == "--speed=1x")
+      realtime = true;
+    else if (arg == "--speed=max")
+      realtime = false;
+    else if (arg.compare(0, 9, "--target=") == 0 && net_address::parse(arg.substr(9), target))
+      continue;
+    else
+    {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (target.empty())
+    return replay_in_process(path, seed, repeat, coroutines);
+  return replay_loopback(path, target, realtime);
+}
@@ -0,0 +1,135 @@
+#include "request_tracer.h"
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+namespace
+{
+
+// Названия промежутков между соседними этапами
+const char * const span_names[request_tracer::stage_count - 1] =
+{
+  "decode",
+  "dispatch",
+  "encode",
+  "queue",
+  "write_buf"
+};
+
+void write_event(std::ostream & out, bool & first, const char * name, const request_tracer::record & rec,
+                 uint64_t begin_ns, uint64_t end_ns)
+{
+  if (first == false)
+    out << ",\n";
+  first = false;
+  // Время в Chrome trace - в микросекундах, дробная часть сохраняет наносекунды
+  out << "{\"name\":\"" << name << "\",\"cat\":\"roll\",\"ph\":\"X\",\"pid\":1,\"tid\":" << rec.conn
+      << ",\"ts\":" << begin_ns / 1000 << "." << std::setw(3) << std::setfill('0') << begin_ns % 1000
+      << ",\"dur\":" << (end_ns - begin_ns) / 1000 << "." << std::setw(3) << std::setfill('0')
+      << (end_ns - begin_ns) % 1000
+      << ",\"args\":{\"request\":" << rec.number << ",\"command\":\"" << rec.command << "\"}}";
+}
+
+}
+
+void request_tracer::configure(uint32_t every, size_t capacity)
+{
+  sample_every = every;
+  if (every == 0)
+  {
+    active = false;
+    waiting.clear();
+  }
+  if (capacity != ring.size())
+  {
+    ring.assign(capacity, record{});
+    ring_next = 0;
+    ring_full = false;
+  }
+}
+
+void request_tracer::begin()
+{
+  // Предыдущая выбранная команда не дошла до буфера на отправку
+  if (active)
+    drop();
+  current = record{};
+  current.conn = read_conn;
+  current.number = decoded;
+  current.ns[stage_read] = read_ns;
+  current.ns[stage_decoded] = now_ns();
+  active = true;
+}
+
+void request_tracer::drop()
+{
+  active = false;
+  ++dropped;
+}
+
+void request_tracer::dispatched(const std::string & type)
+{
+  current.ns[stage_dispatched] = now_ns();
+  // Название команды приходит от клиента, поэтому в JSON оставляем только безопасные символы
+  size_t len = std::min(type.size(), sizeof(current.command) - 1);
+  for (size_t i = 0; i < len; ++i)
+  {
+    unsigned char c = static_cast<unsigned char>(type[i]);
+    current.command[i] = std::isalnum(c) || c == '_' ? static_cast<char>(c) : '_';
+  }
+  current.command[len] = '\0';
+}
+
+void request_tracer::queued()
+{
+  active = false;
+  current.ns[stage_queued] = now_ns();
+  // Если предыдущий выбранный ответ этого соединения ещё не отправлен, новую команду пропускаем
+  if (waiting.emplace(current.conn, current).second == false)
+    ++dropped;
+}
+
+void request_tracer::written(connection_id conn)
+{
+  auto it = waiting.find(conn);
+  if (it == waiting.end())
+    return;
+  it->second.ns[stage_written] = now_ns();
+  if (ring.empty() == false)
+  {
+    ring[ring_next] = it->second;
+    ring_next = (ring_next + 1) % ring.size();
+    ring_full = ring_full || ring_next == 0;
+  }
+  waiting.erase(it);
+}
+
+bool request_tracer::dump(const std::string & path) const
+{
+  std::ofstream out(path, std::ios::trunc);
+  if (out.is_open() == false)
+  {
+    std::cerr << "cannot open trace file: " << path << std::endl;
+    return false;
+  }
+
+  out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+  bool first = true;
+  size_t count = record_count();
+  size_t start = ring_full ? ring_next : 0;
+  for (size_t i = 0; i < count; ++i)
+  {
+    const record & rec = ring[(start + i) % ring.size()];
+    write_event(out, first, "request", rec, rec.ns[stage_read], rec.ns[stage_written]);
+    for (size_t s = stage_read; s + 1 < stage_count; ++s)
+    {
+      // Этап мог не случиться, например, ответ без кодирования
+      if (rec.ns[s] != 0 && rec.ns[s + 1] >= rec.ns[s])
+        write_event(out, first, span_names[s], rec, rec.ns[s], rec.ns[s + 1]);
+    }
+  }
+  out << "\n]}\n";
+  return out.good();
+}
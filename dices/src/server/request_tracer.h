@@ -0,0 +1,163 @@
+#ifndef REQUEST_TRACER_H
+#define REQUEST_TRACER_H
+
+#include "common_types.h"
+#include <array>
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Трассировщик запросов с выборкой
+// Для каждой N-й команды, пришедшей по TCP, запоминает время прохождения этапов:
+//  приём(recv), декодирование, выполнение, кодирование ответа, добавление в буфер на отправку
+//  и момент, когда буфер целиком ушёл в сокет
+// Последние записи хранятся в кольцевом буфере и выгружаются в формате Chrome trace,
+//  который открывается в Perfetto(ui.perfetto.dev) или chrome://tracing
+// Работает только в потоке цикла менеджера подключений, поэтому без блокировок
+// Пока выборка выключена, каждая точка стоит одной проверки
+// Не трассируются команды, отданные в пул потоков, команды, ответ на которые ждёт ответов
+//  на более ранние команды этого соединения, и команды UDP-сервиса
+class request_tracer
+{
+public:
+  // Этапы запроса в порядке прохождения
+  enum stage
+  {
+    stage_read,
+    stage_decoded,
+    stage_dispatched,
+    stage_encoded,
+    stage_queued,
+    stage_written,
+    stage_count
+  };
+
+  struct record
+  {
+    connection_id conn = 0;
+    // Номер команды среди всех, прошедших через трассировщик
+    uint64_t number = 0;
+    std::array<uint64_t, stage_count> ns{};
+    char command[16] = {};
+  };
+
+  // every - трассировать каждую every-ю команду, 0 выключает трассировку
+  // capacity - сколько последних записей хранить, при изменении записи сбрасываются
+  void configure(uint32_t every, size_t capacity);
+  bool enabled() const { return sample_every != 0; }
+
+  // Точки на пути запроса
+  void on_read(connection_id conn)
+  {
+    if (sample_every == 0)
+      return;
+    read_conn = conn;
+    read_ns = now_ns();
+    reading = true;
+  }
+
+  void on_read_done()
+  {
+    reading = false;
+    if (active)
+      drop();
+  }
+
+  void on_decoded()
+  {
+    if (sample_every != 0 && reading && ++decoded % sample_every == 0)
+      begin();
+  }
+
+  void on_dispatched(const std::string & type)
+  {
+    if (active)
+      dispatched(type);
+  }
+
+  void on_offloaded()
+  {
+    if (active)
+      drop();
+  }
+
+  // Ответ отложен до ответов на более ранние команды
+  // Следующим кодироваться будет чужой ответ, поэтому выбранная команда отбрасывается
+  void on_held()
+  {
+    if (active)
+      drop();
+  }
+
+  void on_encoded(connection_id conn)
+  {
+    if (active && current.conn == conn)
+      current.ns[stage_encoded] = now_ns();
+  }
+
+  void on_queued(connection_id conn)
+  {
+    if (active && current.conn == conn)
+      queued();
+  }
+
+  // Вызывается, когда буфер на отправку ушёл в сокет целиком
+  void on_written(connection_id conn)
+  {
+    if (waiting.empty() == false)
+      written(conn);
+  }
+
+  void on_closed(connection_id conn)
+  {
+    if (waiting.empty() == false)
+      waiting.erase(conn);
+  }
+
+  size_t record_count() const { return ring_full ? ring.size() : ring_next; }
+  // Сколько выбранных команд не дошли до конца: соединение закрылось, команда ушла в пул и т.д.
+  uint64_t dropped_count() const { return dropped; }
+
+  // Записывает накопленные записи в файл в формате Chrome trace JSON
+  [[nodiscard]]
+  bool dump(const std::string & path) const;
+
+private:
+  uint32_t sample_every = 0;
+  uint64_t decoded = 0;
+  uint64_t dropped = 0;
+
+  bool reading = false;
+  connection_id read_conn = 0;
+  uint64_t read_ns = 0;
+
+  // Запись, проходящая синхронную часть пути: от декодирования до добавления в буфер
+  bool active = false;
+  record current;
+  // Записи, ответ которых лежит в буфере на отправку
+  // Выбирается не больше одной команды на соединение одновременно
+  std::unordered_map<connection_id, record> waiting;
+
+  std::vector<record> ring;
+  size_t ring_next = 0;
+  bool ring_full = false;
+
+  static uint64_t now_ns()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void begin();
+  void drop();
+  void dispatched(const std::string & type);
+  void queued();
+  void written(connection_id conn);
+};
+
+// Трассировщик процесса: точки стоят в менеджере подключений, декодере и обработчике,
+//  которые друг о друге не знают
+inline request_tracer tracer;
+
+#endif // REQUEST_TRACER_H
@@ -0,0 +1,223 @@
+#include "server_config.h"
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+
+namespace
+{
+
+// Верхние границы параметров, применяемых на лету: ошибка в файле не должна ронять
+//  работающий сервер после SIGHUP
+constexpr uint32_t max_recv_chunk = 1 << 20;
+constexpr uint32_t max_spin_us = 1000000;
+constexpr size_t max_command_length_limit = 1 << 20;
+
+bool parse_uint(const std::string & str, uint64_t max, uint64_t & out)
+{
+  if (str.empty() || str.find_first_not_of("0123456789") != str.npos || str.size() > 19)
+    return false;
+  out = std::strtoull(str.c_str(), nullptr, 10);
+  return out <= max;
+}
+
+template<class T>
+bool parse_uint(const std::string & str, T & out)
+{
+  uint64_t val = 0;
+  if (parse_uint(str, std::numeric_limits<T>::max(), val) == false)
+    return false;
+  out = static_cast<T>(val);
+  return true;
+}
+
+bool parse_float(const std::string & str, float & out)
+{
+  char * end = nullptr;
+  out = std::strtof(str.c_str(), &end);
+  return str.empty() == false && *end == '\0' && out >= 0;
+}
+
+bool parse_bool(const std::string & str, bool & out)
+{
+  if (str == "on" || str == "true" || str == "yes" || str == "1")
+    out = true;
+  else if (str == "off" || str == "false" || str == "no" || str == "0")
+    out = false;
+  else
+    return false;
+  return true;
+}
+
+std::string trim(const std::string & str)
+{
+  auto begin = str.find_first_not_of(" \t\r");
+  if (begin == str.npos)
+    return {};
+  auto end = str.find_last_not_of(" \t\r");
+  return str.substr(begin, end - begin + 1);
+}
+
+}
+
+bool apply_config_option(const std::string & key, const std::string & value,
+                         server_config & cfg, std::string & error)
+{
+  bool ok = true;
+  net_address address;
+
+  // Требуют перезапуска
+  if (key == "listen" || key == "udp" || key == "tls_listen")
+  {
+    ok = net_address::parse(value, address);
+    if (ok)
+      (key == "listen" ? cfg.listen : key == "udp" ? cfg.udp : cfg.tls_listen).push_back(address);
+  }
+  else if (key == "tls_cert")
+    ok = (cfg.tls_cert = value).empty() == false;
+  else if (key == "tls_key")
+    ok = (cfg.tls_key = value).empty() == false;
+  else if (key == "limits")
+    ok = parse_bool(value, cfg.limits_enabled);
+  else if (key == "seed")
+    ok = cfg.has_seed = parse_uint(value, cfg.seed);
+  else if (key == "capture")
+    cfg.capture_path = value;
+  else if (key == "listen_backlog")
+    ok = parse_uint(value, cfg.loop.listen_backlog);
+  else if (key == "worker_threads")
+    ok = parse_uint(value, cfg.worker_threads) && cfg.worker_threads <= 256;
+  else if (key == "session_api")
+  {
+    ok = value == "callback" || value == "coroutine";
+    cfg.coroutine_sessions = value == "coroutine";
+  }
+  // Применяются на лету
+  else if (key == "recv_chunk")
+    ok = parse_uint(value, cfg.loop.recv_chunk) && cfg.loop.recv_chunk != 0 &&
+         cfg.loop.recv_chunk <= max_recv_chunk;
+  else if (key == "select_timeout_ms")
+    ok = parse_uint(value, cfg.loop.select_timeout_ms) && cfg.loop.select_timeout_ms != 0;
+  else if (key == "spin_us")
+    ok = parse_uint(value, cfg.loop.spin_us) && cfg.loop.spin_us <= max_spin_us;
+  else if (key == "busy_poll_us")
+    ok = parse_uint(value, cfg.loop.busy_poll_us);
+  else if (key == "cpu")
+    ok = value == "-1" ? (cfg.loop.cpu = -1, true) : parse_uint(value, cfg.loop.cpu);
+  else if (key == "max_connections")
+    ok = parse_uint(value, cfg.limits.max_connections) && cfg.limits.max_connections <= max_select_connections;
+  else if (key == "max_connections_per_address")
+    ok = parse_uint(value, cfg.limits.max_connections_per_address) &&
+         cfg.limits.max_connections_per_address <= max_select_connections;
+  else if (key == "connection_rate")
+    ok = parse_float(value, cfg.limits.connection_rate);
+  else if (key == "connection_burst")
+    ok = parse_float(value, cfg.limits.connection_burst);
+  else if (key == "address_rate")
+    ok = parse_float(value, cfg.limits.address_rate);
+  else if (key == "address_burst")
+    ok = parse_float(value, cfg.limits.address_burst);
+  else if (key == "max_command_length")
+    ok = parse_uint(value, cfg.max_command_length) && cfg.max_command_length != 0 &&
+         cfg.max_command_length <= max_command_length_limit;
+  else if (key == "idle_session_sec")
+    ok = parse_uint(value, cfg.idle_session_sec);
+  else if (key == "log_level")
+    ok = parse_log_level(value, cfg.level);
+  else if (key == "trace_sample")
+    ok = parse_uint(value, cfg.trace_sample);
+  else if (key == "trace_buffer")
+    ok = parse_uint(value, cfg.trace_buffer) && cfg.trace_buffer <= 1000000;
+  else if (key == "handshake_timeout_ms")
+    ok = parse_uint(value, cfg.handshake_timeout_ms);
+  else if (key == "trace_file")
+    ok = (cfg.trace_file = value).empty() == false;
+  else
+  {
+    error = "unknown option: " + key;
+    return false;
+  }
+
+  if (ok == false)
+    error = "invalid value for " + key + ": " + value;
+  return ok;
+}
+
+bool load_config_file(const std::string & path, server_config & cfg)
+{
+  std::ifstream in(path);
+  if (in.is_open() == false)
+  {
+    std::cerr << "cannot open config file: " << path << std::endl;
+    return false;
+  }
+
+  // Читаем файл до конца, чтобы показать сразу все ошибки
+  bool ok = true;
+  std::string line;
+  for (int line_no = 1; std::getline(in, line); ++line_no)
+  {
+    line = trim(line);
+    if (line.empty() || line.front() == '#')
+      continue;
+
+    auto eq = line.find('=');
+    std::string error;
+    if (eq == line.npos)
+      error = "expected key = value";
+    else if (apply_config_option(trim(line.substr(0, eq)), trim(line.substr(eq + 1)), cfg, error))
+      continue;
+
+    std::cerr << path << ":" << line_no << ": " << error << std::endl;
+    ok = false;
+  }
+  return ok;
+}
+
+bool build_config(const std::string & path, const config_overrides & overrides, server_config & cfg)
+{
+  cfg = server_config{};
+  if (path.empty() == false && load_config_file(path, cfg) == false)
+    return false;
+
+  bool ok = true;
+  for (const auto & [key, value] : overrides)
+  {
+    std::string error;
+    if (apply_config_option(key, value, cfg, error) == false)
+    {
+      std::cerr << error << std::endl;
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+std::vector<std::string> restart_required_changes(const server_config & current,
+                                                  const server_config & updated)
+{
+  std::vector<std::string> ret;
+  if (current.listen != updated.listen)
+    ret.push_back("listen");
+  if (current.tls_listen != updated.tls_listen)
+    ret.push_back("tls_listen");
+  if (current.tls_cert != updated.tls_cert)
+    ret.push_back("tls_cert");
+  if (current.tls_key != updated.tls_key)
+    ret.push_back("tls_key");
+  if (current.udp != updated.udp)
+    ret.push_back("udp");
+  if (current.limits_enabled != updated.limits_enabled)
+    ret.push_back("limits");
+  if (current.has_seed != updated.has_seed || current.seed != updated.seed)
+    ret.push_back("seed");
+  if (current.capture_path != updated.capture_path)
+    ret.push_back("capture");
+  if (current.loop.listen_backlog != updated.loop.listen_backlog)
+    ret.push_back("listen_backlog");
+  if (current.worker_threads != updated.worker_threads)
+    ret.push_back("worker_threads");
+  if (current.coroutine_sessions != updated.coroutine_sessions)
+    ret.push_back("session_api");
+  return ret;
+}
@@ -0,0 +1,79 @@
+#ifndef SERVER_CONFIG_H
+#define SERVER_CONFIG_H
+
+#include "connection_manager.h"
+#include "admission_control.h"
+#include "logger.h"
+#include <string>
+#include <vector>
+
+// Конфигурация сервера
+// Читается из файла вида "ключ = значение", строки, начинающиеся с #, - комментарии:
+//
+//   listen = 0.0.0.0:35555
+//   listen = unix:/tmp/roll.sock
+//   tls_listen = 0.0.0.0:35443
+//   udp = 0.0.0.0:35556
+//   recv_chunk = 512
+//   log_level = warning
+//
+// Те же ключи можно передать в командной строке: --recv-chunk=512
+// По сигналу SIGHUP файл перечитывается, и часть параметров применяется без разрыва соединений
+// Требуют перезапуска: listen, tls_listen, tls_cert, tls_key, udp, limits, seed, capture, listen_backlog,
+//  worker_threads и session_api,
+//  их изменение при перечитывании только выводит предупреждение
+struct server_config
+{
+  // Требуют перезапуска
+  std::vector<net_address> listen;
+  // Адреса, на которых соединения шифруются TLS, нужны tls_cert и tls_key
+  std::vector<net_address> tls_listen;
+  std::string tls_cert;
+  std::string tls_key;
+  std::vector<net_address> udp;
+  bool limits_enabled = true;
+  bool has_seed = false;
+  unsigned seed = 0;
+  std::string capture_path;
+  // Потоки для тяжёлых команд, 0 - выполнять их в потоке ввода-вывода
+  size_t worker_threads = 2;
+  // session_api = coroutine: сессии обслуживаются сопрограммами, callback - обработчиками
+  bool coroutine_sessions = false;
+
+  // Применяются на лету, кроме loop.listen_backlog
+  loop_options loop;
+  admission_limits limits;
+  size_t max_command_length = 1536;
+  uint32_t idle_session_sec = 5;
+  log_level level = log_level::info;
+  // Трассировка каждой trace_sample-й команды, 0 - выключена
+  uint32_t trace_sample = 0;
+  // Сколько последних записей трассировки хранить
+  size_t trace_buffer = 4096;
+  // Куда выгружать трассировку по SIGUSR1 и при остановке
+  std::string trace_file = "roll_trace.json";
+  // Сколько сопрограммная сессия ждёт hello, 0 - без ограничения
+  uint32_t handshake_timeout_ms = 0;
+};
+
+// Применяет одну пару ключ-значение, при ошибке возвращает false и текст ошибки
+[[nodiscard]]
+bool apply_config_option(const std::string & key, const std::string & value,
+                         server_config & cfg, std::string & error);
+
+// Читает файл поверх уже заполненной конфигурации, ошибки печатаются с номерами строк
+[[nodiscard]]
+bool load_config_file(const std::string & path, server_config & cfg);
+
+// Параметры командной строки в виде пар ключ-значение, применяются поверх файла
+using config_overrides = std::vector<std::pair<std::string, std::string>>;
+
+// Собирает конфигурацию: значения по умолчанию, затем файл(если path не пуст), затем переопределения
+[[nodiscard]]
+bool build_config(const std::string & path, const config_overrides & overrides, server_config & cfg);
+
+// Возвращает названия изменившихся параметров, которые нельзя применить без перезапуска
+std::vector<std::string> restart_required_changes(const server_config & current,
+                                                  const server_config & updated);
+
+#endif // SERVER_CONFIG_H
@@ -0,0 +1,111 @@
+#include "task_executor.h"
+#include <iostream>
+
+namespace
+{
+
+// Пул, которому принадлежит текущий поток, и индекс его очереди
+thread_local const task_executor * current_executor = nullptr;
+thread_local size_t current_index = 0;
+
+}
+
+task_executor::task_executor(size_t threads) :
+  next_queue(0),
+  stolen(0),
+  queued(0),
+  stopping(false)
+{
+  if (threads == 0)
+    threads = 1;
+  for (size_t i = 0; i < threads; ++i)
+    queues.push_back(std::make_unique<worker_queue>());
+  for (size_t i = 0; i < threads; ++i)
+    workers.emplace_back(&task_executor::worker_loop, this, i);
+}
+
+task_executor::~task_executor()
+{
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    stopping = true;
+  }
+  wakeup.notify_all();
+  for (auto & worker : workers)
+    worker.join();
+}
+
+void task_executor::submit(task t)
+{
+  size_t index = current_executor == this ? current_index
+                                          : next_queue.fetch_add(1, std::memory_order_relaxed) % queues.size();
+  {
+    std::lock_guard<std::mutex> lock(queues[index]->mutex);
+    queues[index]->tasks.push_back(std::move(t));
+  }
+  // Счётчик меняется под мьютексом сна, иначе поток может проверить его и уснуть, пропустив задачу
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    ++queued;
+  }
+  wakeup.notify_one();
+}
+
+bool task_executor::try_pop(size_t index, task & out)
+{
+  worker_queue & q = *queues[index];
+  std::lock_guard<std::mutex> lock(q.mutex);
+  if (q.tasks.empty())
+    return false;
+  out = std::move(q.tasks.front());
+  q.tasks.pop_front();
+  return true;
+}
+
+bool task_executor::try_steal(size_t index, task & out)
+{
+  // Обходим чужие очереди, начиная со следующей, чтобы потоки не толпились у одной
+  for (size_t i = 1; i < queues.size(); ++i)
+  {
+    worker_queue & q = *queues[(index + i) % queues.size()];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if (q.tasks.empty())
+      continue;
+    out = std::move(q.tasks.back());
+    q.tasks.pop_back();
+    stolen.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+  return false;
+}
+
+void task_executor::worker_loop(size_t index)
+{
+  current_executor = this;
+  current_index = index;
+  for (;;)
+  {
+    task t;
+    if (try_pop(index, t) || try_steal(index, t))
+    {
+      {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        --queued;
+      }
+      try
+      {
+        t();
+      }
+      catch (const std::exception & e)
+      {
+        std::cerr << "task failed: " << e.what() << std::endl;
+      }
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(sleep_mutex);
+    wakeup.wait(lock, [this] { return stopping || queued != 0; });
+    if (stopping)
+      return;
+  }
+}
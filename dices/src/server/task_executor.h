@@ -0,0 +1,62 @@
+#ifndef TASK_EXECUTOR_H
+#define TASK_EXECUTOR_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков с перехватом задач(work stealing) для тяжёлых команд,
+//  которые нельзя выполнять в потоке ввода-вывода
+// У каждого потока своя очередь: задачи раскладываются по очередям по кругу,
+//  поток берёт задачи из начала своей очереди, а когда она пуста - из конца чужих
+// Задача, поставленная из потока пула, попадает в его собственную очередь
+// Результаты в поток ввода-вывода пул не возвращает, для этого есть completion_queue
+class task_executor
+{
+public:
+  using task = std::function<void()>;
+
+  explicit task_executor(size_t threads);
+  // Дожидается завершения уже начатых задач, оставшиеся в очередях задачи выбрасываются
+  ~task_executor();
+
+  task_executor(const task_executor &) = delete;
+  task_executor & operator=(const task_executor &) = delete;
+
+  // Можно вызывать из любого потока
+  void submit(task t);
+
+  size_t thread_count() const { return workers.size(); }
+  // Сколько задач было взято из чужих очередей, для статистики
+  uint64_t stolen_count() const { return stolen.load(std::memory_order_relaxed); }
+
+private:
+  struct worker_queue
+  {
+    std::mutex mutex;
+    std::deque<task> tasks;
+  };
+
+  std::vector<std::unique_ptr<worker_queue>> queues;
+  std::vector<std::thread> workers;
+  // Очередь, в которую положить следующую задачу из чужого потока
+  std::atomic<size_t> next_queue;
+  std::atomic<uint64_t> stolen;
+
+  // Спящие потоки ждут здесь, queued - количество задач во всех очередях
+  std::mutex sleep_mutex;
+  std::condition_variable wakeup;
+  size_t queued;
+  bool stopping;
+
+  void worker_loop(size_t index);
+  bool try_pop(size_t index, task & out);
+  bool try_steal(size_t index, task & out);
+};
+
+#endif // TASK_EXECUTOR_H
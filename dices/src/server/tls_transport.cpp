@@ -0,0 +1,237 @@
+#include "tls_transport.h"
+#include "logger.h"
+#include <iostream>
+
+#ifdef ROLL_ENABLE_TLS
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+namespace
+{
+
+void print_ssl_error(const std::string & text)
+{
+  char reason[256] = "unknown error";
+  unsigned long ec = ERR_get_error();
+  if (ec != 0)
+    ERR_error_string_n(ec, reason, sizeof(reason));
+  // Остальные ошибки из очереди потока уже не нужны
+  ERR_clear_error();
+  std::cerr << "Error text: " << text << ", reason: " << reason << std::endl;
+}
+
+} // namespace
+
+tls_context::~tls_context()
+{
+  SSL_CTX_free(ctx);
+}
+
+std::unique_ptr<tls_context> tls_context::create(const std::string & cert_path, const std::string & key_path)
+{
+  SSL_CTX * ctx = SSL_CTX_new(TLS_server_method());
+  if (ctx == nullptr)
+  {
+    print_ssl_error("tls context");
+    return nullptr;
+  }
+  std::unique_ptr<tls_context> ret(new tls_context(ctx));
+
+  if (SSL_CTX_use_certificate_chain_file(ctx, cert_path.c_str()) != 1)
+  {
+    print_ssl_error("tls certificate " + cert_path);
+    return nullptr;
+  }
+  if (SSL_CTX_use_PrivateKey_file(ctx, key_path.c_str(), SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(ctx) != 1)
+  {
+    print_ssl_error("tls key " + key_path);
+    return nullptr;
+  }
+
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  // Пересогласование и билеты сессий после рукопожатия - это служебные записи посреди потока данных,
+  //  recv на сокете с kTLS вместо них вернёт ошибку, поэтому отключаем и то, и другое
+  SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION);
+  SSL_CTX_set_num_tickets(ctx, 0);
+#ifdef SSL_OP_ENABLE_KTLS
+  // Передать ключи ядру OpenSSL пытается сам по окончании рукопожатия
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+  // Буфер записи соединения может перевыделиться между повторами SSL_write
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  return ret;
+}
+
+tls_session::~tls_session()
+{
+  SSL_free(ssl);
+}
+
+std::unique_ptr<tls_session> tls_session::accept(const tls_context & ctx, SOCKET sock)
+{
+  SSL * ssl = SSL_new(ctx.native());
+  if (ssl == nullptr)
+  {
+    print_ssl_error("tls session");
+    return nullptr;
+  }
+  std::unique_ptr<tls_session> ret(new tls_session(ssl));
+  if (SSL_set_fd(ssl, static_cast<int>(sock)) != 1)
+  {
+    print_ssl_error("tls session socket");
+    return nullptr;
+  }
+  SSL_set_accept_state(ssl);
+  return ret;
+}
+
+bool tls_session::handshake()
+{
+  if (state != state_handshake)
+    return state == state_established;
+
+  int res = SSL_do_handshake(ssl);
+  if (res != 1)
+  {
+    if (check(res) < 0 && would_block())
+      return true;
+    state = state_failed;
+    return false;
+  }
+
+  state = state_established;
+  want_read = false;
+  want_write = false;
+  // BIO_get_ktls_* появились в OpenSSL 3.0, со старыми версиями обе стороны идут через SSL_read/SSL_write
+#ifdef BIO_get_ktls_send
+  kernel_send = BIO_get_ktls_send(SSL_get_wbio(ssl)) != 0;
+  kernel_recv = BIO_get_ktls_recv(SSL_get_rbio(ssl)) != 0;
+#endif
+  return true;
+}
+
+bool tls_session::ktls_recv() const
+{
+  // Записи, которые OpenSSL успел прочитать вместе с рукопожатием, лежат в его буфере,
+  //  их нужно забрать через SSL_read, прежде чем читать из сокета напрямую
+  return kernel_recv && SSL_has_pending(ssl) == 0;
+}
+
+ssize_t tls_session::read(void * data, size_t size)
+{
+  return check(SSL_read(ssl, data, static_cast<int>(size)));
+}
+
+ssize_t tls_session::write(const void * data, size_t size)
+{
+  return check(SSL_write(ssl, data, static_cast<int>(size)));
+}
+
+void tls_session::shutdown()
+{
+  if (state != state_established)
+    return;
+  state = state_failed;
+  // Ответный close_notify не ждём, соединение всё равно закрывается
+  if (SSL_shutdown(ssl) < 0)
+    ERR_clear_error();
+}
+
+std::string tls_session::description() const
+{
+  std::string ret = SSL_get_version(ssl);
+  ret += ' ';
+  ret += SSL_get_cipher_name(ssl);
+  ret += kernel_send ? ", ktls tx" : "";
+  ret += kernel_recv ? ", ktls rx" : "";
+  return ret;
+}
+
+int tls_session::check(int res)
+{
+  want_read = false;
+  want_write = false;
+  if (res > 0)
+    return res;
+
+  switch (SSL_get_error(ssl, res))
+  {
+  case SSL_ERROR_WANT_READ:
+    want_read = true;
+    return -1;
+  case SSL_ERROR_WANT_WRITE:
+    want_write = true;
+    return -1;
+  // Удалённая сторона прислала close_notify
+  case SSL_ERROR_ZERO_RETURN:
+    return 0;
+  case SSL_ERROR_SYSCALL:
+    // Соединение оборвано без close_notify, для сервера это то же, что закрытие
+    if (ERR_peek_error() == 0 && res == 0)
+      return 0;
+    [[fallthrough]];
+  default:
+    // Неудачное рукопожатие - обычно вина клиента(сканер портов, открытый текст), поэтому только в журнал
+    if (state == state_handshake && log_enabled(log_level::info))
+      print_ssl_error("tls handshake");
+    else
+      ERR_clear_error();
+    return -1;
+  }
+}
+
+#else
+
+// Сборка без OpenSSL: TLS-слушатели не создаются, и сессии до этих функций не доходят
+
+tls_context::~tls_context() = default;
+
+std::unique_ptr<tls_context> tls_context::create(const std::string &, const std::string &)
+{
+  std::cerr << "server is built without TLS support" << std::endl;
+  return nullptr;
+}
+
+tls_session::~tls_session() = default;
+
+std::unique_ptr<tls_session> tls_session::accept(const tls_context &, SOCKET)
+{
+  return nullptr;
+}
+
+bool tls_session::handshake()
+{
+  return false;
+}
+
+bool tls_session::ktls_recv() const
+{
+  return false;
+}
+
+ssize_t tls_session::read(void *, size_t)
+{
+  return -1;
+}
+
+ssize_t tls_session::write(const void *, size_t)
+{
+  return -1;
+}
+
+void tls_session::shutdown()
+{}
+
+std::string tls_session::description() const
+{
+  return {};
+}
+
+int tls_session::check(int res)
+{
+  return res;
+}
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef TLS_TRANSPORT_H
+#define TLS_TRANSPORT_H
+
+#include "network_utils.h"
+#include <chrono>
+#include <memory>
+#include <string>
+
+// Шифрование соединений для TLS-слушателей
+// Рукопожатие делает OpenSSL, после чего ключи сессии передаются ядру(kTLS, TLS_TX/TLS_RX),
+//  и дальше соединение обслуживается обычными recv/send над открытым текстом, без копий в OpenSSL
+// Если ядро или шифр не поддерживают kTLS в какую-то сторону(например, приём для TLS 1.3
+//  в OpenSSL 3.0 или нет модуля tls), эта сторона работает через SSL_read/SSL_write
+// Собирается с опцией ROLL_TLS при найденном OpenSSL, иначе TLS-слушатель не создаётся
+
+struct ssl_ctx_st;
+struct ssl_st;
+
+// Контекст TLS-слушателя: сертификат, ключ и настройки
+class tls_context
+{
+public:
+  ~tls_context();
+
+  // Возвращает nullptr и печатает ошибку, если сертификат или ключ не подходят
+  static std::unique_ptr<tls_context> create(const std::string & cert_path, const std::string & key_path);
+
+  ssl_ctx_st * native() const { return ctx; }
+
+private:
+  explicit tls_context(ssl_ctx_st * ctx) : ctx(ctx) {}
+  ssl_ctx_st * ctx;
+};
+
+// TLS-сессия одного соединения
+// read и write ведут себя как recv и send: >0 - байты, 0 - соединение закрыто,
+//  <0 - ошибка или операцию нужно повторить позже, тогда would_block() возвращает true
+class tls_session
+{
+public:
+  ~tls_session();
+
+  static std::unique_ptr<tls_session> accept(const tls_context & ctx, SOCKET sock);
+
+  // Продолжает рукопожатие, false - рукопожатие не удалось
+  // Пока established() == false, нужно вызывать снова, когда сокет готов к wants_write() ? записи : чтению
+  [[nodiscard]]
+  bool handshake();
+  bool established() const { return state == state_established; }
+  bool wants_write() const { return want_write; }
+  // Момент создания сессии, по нему закрываются слишком долгие рукопожатия
+  std::chrono::steady_clock::time_point accepted_at() const { return accepted; }
+
+  // Какие стороны обслуживает ядро, для них можно пользоваться recv/send напрямую
+  // На сокете с kTLS приёма служебная запись(например, close_notify) приходит ошибкой recv
+  bool ktls_send() const { return kernel_send; }
+  bool ktls_recv() const;
+
+  ssize_t read(void * data, size_t size);
+  ssize_t write(const void * data, size_t size);
+  bool would_block() const { return want_read || want_write; }
+
+  // Посылает close_notify, не дожидаясь ответа
+  void shutdown();
+
+  // Версия протокола и шифр для журнала
+  std::string description() const;
+
+private:
+  explicit tls_session(ssl_st * ssl) : ssl(ssl) {}
+
+  enum session_state : uint8_t
+  {
+    state_handshake,
+    state_established,
+    state_failed
+  };
+
+  ssl_st * ssl;
+  std::chrono::steady_clock::time_point accepted = std::chrono::steady_clock::now();
+  session_state state = state_handshake;
+  bool want_read = false;
+  bool want_write = false;
+  bool kernel_send = false;
+  bool kernel_recv = false;
+
+  // Разбирает результат SSL_* и выставляет want_read/want_write
+  int check(int res);
+};
+
+#endif // TLS_TRANSPORT_H
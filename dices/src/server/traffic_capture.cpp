@@ -0,0 +1,174 @@
+#include "traffic_capture.h"
+#include <algorithm>
+#include <iostream>
+
+namespace
+{
+
+constexpr char capture_magic[8] = {'R', 'O', 'L', 'L', 'C', 'A', 'P', '1'};
+// Размер заголовка записи без данных
+constexpr size_t record_header_size = 8 + 4 + 1 + 4;
+// Буфер записи, чтобы не делать системный вызов на каждый принятый кусок
+constexpr size_t write_buffer_size = 1 << 20;
+
+}
+
+capture_writer::capture_writer() :
+  file(nullptr)
+{}
+
+capture_writer::~capture_writer()
+{
+  close();
+}
+
+bool capture_writer::open(const std::string & path)
+{
+  close();
+  file = std::fopen(path.c_str(), "wb");
+  if (file == nullptr)
+  {
+    std::cerr << "cannot open capture file: " << path << std::endl;
+    return false;
+  }
+  std::setvbuf(file, nullptr, _IOFBF, write_buffer_size);
+  write_bytes(capture_magic, sizeof(capture_magic));
+  started = std::chrono::steady_clock::now();
+  return file != nullptr;
+}
+
+void capture_writer::close()
+{
+  if (file == nullptr)
+    return;
+  if (std::fclose(file) != 0)
+    std::cerr << "capture file write failed, capture may be incomplete" << std::endl;
+  file = nullptr;
+}
+
+void capture_writer::write_open(connection_id id)
+{
+  write_record(id, capture_record_type::open, nullptr, 0);
+}
+
+void capture_writer::write_data(connection_id id, const buffer_type & buf)
+{
+  // Разбиение на записи для воспроизведения ничего не меняет: данные соединения всё равно поток
+  for (size_t offset = 0; offset < buf.size(); offset += max_record_size)
+  {
+    size_t size = std::min<size_t>(buf.size() - offset, max_record_size);
+    write_record(id, capture_record_type::data, buf.data() + offset, static_cast<uint32_t>(size));
+  }
+}
+
+void capture_writer::write_close(connection_id id)
+{
+  write_record(id, capture_record_type::close, nullptr, 0);
+}
+
+void capture_writer::write_record(connection_id id, capture_record_type type,
+                                  const uint8_t * data, uint32_t size)
+{
+  if (file == nullptr)
+    return;
+
+  uint64_t ts = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - started).count();
+  uint32_t conn = static_cast<uint32_t>(id);
+
+  uint8_t header[record_header_size];
+  ::memcpy(header, &ts, 8);
+  ::memcpy(header + 8, &conn, 4);
+  header[12] = static_cast<uint8_t>(type);
+  ::memcpy(header + 13, &size, 4);
+
+  write_bytes(header, sizeof(header));
+  if (size != 0)
+    write_bytes(data, size);
+}
+
+void capture_writer::write_bytes(const void * data, size_t size)
+{
+  if (file == nullptr)
+    return;
+  if (std::fwrite(data, 1, size, file) != size)
+  {
+    // Файл с оборванной записью ещё можно воспроизвести до места ошибки, но дальше писать бессмысленно
+    std::cerr << "capture file write failed, capture stopped" << std::endl;
+    std::fclose(file);
+    file = nullptr;
+  }
+}
+
+capture_reader::capture_reader() :
+  file(nullptr),
+  remaining(0)
+{}
+
+capture_reader::~capture_reader()
+{
+  if (file != nullptr)
+    std::fclose(file);
+}
+
+bool capture_reader::open(const std::string & path)
+{
+  file = std::fopen(path.c_str(), "rb");
+  if (file == nullptr)
+  {
+    std::cerr << "cannot open capture file: " << path << std::endl;
+    return false;
+  }
+
+  char magic[sizeof(capture_magic)];
+  if (std::fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+      ::memcmp(magic, capture_magic, sizeof(magic)) != 0)
+  {
+    std::cerr << "not a capture file: " << path << std::endl;
+    std::fclose(file);
+    file = nullptr;
+    return false;
+  }
+
+  // Размер файла нужен, чтобы не выделять память под длину из повреждённого заголовка
+  if (std::fseek(file, 0, SEEK_END) != 0)
+  {
+    std::cerr << "cannot seek capture file: " << path << std::endl;
+    std::fclose(file);
+    file = nullptr;
+    return false;
+  }
+  long size = std::ftell(file);
+  std::fseek(file, sizeof(capture_magic), SEEK_SET);
+  remaining = size > static_cast<long>(sizeof(capture_magic)) ? size - sizeof(capture_magic) : 0;
+  return true;
+}
+
+bool capture_reader::next(capture_record & rec)
+{
+  if (file == nullptr)
+    return false;
+
+  uint8_t header[record_header_size];
+  if (remaining < sizeof(header) || std::fread(header, 1, sizeof(header), file) != sizeof(header))
+    return false;
+  remaining -= sizeof(header);
+
+  uint32_t size = 0;
+  ::memcpy(&rec.timestamp_ns, header, 8);
+  ::memcpy(&rec.connection, header + 8, 4);
+  rec.type = static_cast<capture_record_type>(header[12]);
+  ::memcpy(&size, header + 13, 4);
+
+  if (size > max_record_size || size > remaining)
+  {
+    std::cerr << "corrupted capture record, length " << size << std::endl;
+    return false;
+  }
+  remaining -= size;
+
+  rec.data.resize(size);
+  if (size != 0 && std::fread(rec.data.data(), 1, size, file) != size)
+    return false;
+  return true;
+}
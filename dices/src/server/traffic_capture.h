@@ -0,0 +1,84 @@
+#ifndef TRAFFIC_CAPTURE_H
+#define TRAFFIC_CAPTURE_H
+
+#include "common_types.h"
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+// В файле представлены запись и чтение захвата трафика
+// Захват хранит байты ровно в том виде, в каком они пришли в on_connection_read,
+//  поэтому при воспроизведении сохраняется реальная нарезка потока: и по одному байту, и длинные пачки команд
+//
+// Формат файла(порядок байт - как на машине, где делался захват):
+//  - заголовок: 8 байт "ROLLCAP1",
+//  - записи: время в наносекундах от начала захвата(8 байт), идентификатор соединения(4 байта),
+//    тип записи(1 байт), длина данных(4 байта), затем сами данные
+//  - длина данных не больше max_record_size, более длинный принятый буфер пишется несколькими записями
+
+enum class capture_record_type : uint8_t
+{
+  open = 0,
+  data = 1,
+  close = 2
+};
+
+struct capture_record
+{
+  uint64_t timestamp_ns = 0;
+  uint32_t connection = 0;
+  capture_record_type type = capture_record_type::data;
+  buffer_type data;
+};
+
+// Максимальная длина данных одной записи
+constexpr uint32_t max_record_size = 16 << 20;
+
+// Пишет захват в файл, вызовы дешёвые: запись буферизуется
+// При ошибке записи(например, кончилось место на диске) захват останавливается с сообщением об ошибке
+class capture_writer
+{
+public:
+  capture_writer();
+  ~capture_writer();
+  capture_writer(const capture_writer &) = delete;
+  capture_writer & operator=(const capture_writer &) = delete;
+
+  [[nodiscard]]
+  bool open(const std::string & path);
+  void close();
+  bool is_open() const { return file != nullptr; }
+
+  void write_open(connection_id id);
+  void write_data(connection_id id, const buffer_type & buf);
+  void write_close(connection_id id);
+
+private:
+  FILE * file;
+  std::chrono::steady_clock::time_point started;
+
+  void write_record(connection_id id, capture_record_type type, const uint8_t * data, uint32_t size);
+  void write_bytes(const void * data, size_t size);
+};
+
+// Последовательно читает записи захвата
+class capture_reader
+{
+public:
+  capture_reader();
+  ~capture_reader();
+  capture_reader(const capture_reader &) = delete;
+  capture_reader & operator=(const capture_reader &) = delete;
+
+  [[nodiscard]]
+  bool open(const std::string & path);
+  // Возвращает false, когда записи закончились или файл повреждён
+  bool next(capture_record & rec);
+
+private:
+  FILE * file;
+  // Сколько байт осталось до конца файла
+  uint64_t remaining;
+};
+
+#endif // TRAFFIC_CAPTURE_H
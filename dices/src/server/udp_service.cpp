@@ -0,0 +1,402 @@
+#include "udp_service.h"
+#include "command_encoder.h"
+#include "dice.h"
+#include <iostream>
+#include "logger.h"
+#include <random>
+
+namespace
+{
+
+// SipHash-2-4, используется для подписи адресов клиентов
+// Быстрая криптографическая хеш-функция с ключом, подходит для коротких сообщений
+uint64_t rotl(uint64_t x, int b)
+{
+  return (x << b) | (x >> (64 - b));
+}
+
+void sip_round(uint64_t & v0, uint64_t & v1, uint64_t & v2, uint64_t & v3)
+{
+  v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+  v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+  v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+  v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+}
+
+uint64_t siphash(const uint64_t key[2], const uint8_t * data, size_t size)
+{
+  uint64_t v0 = 0x736f6d6570736575ULL ^ key[0];
+  uint64_t v1 = 0x646f72616e646f6dULL ^ key[1];
+  uint64_t v2 = 0x6c7967656e657261ULL ^ key[0];
+  uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+
+  uint64_t b = static_cast<uint64_t>(size) << 56;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8)
+  {
+    uint64_t m = 0;
+    for (size_t j = 0; j < 8; ++j)
+      m |= static_cast<uint64_t>(data[i + j]) << (8 * j);
+    v3 ^= m;
+    sip_round(v0, v1, v2, v3);
+    sip_round(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+  for (size_t j = 0; i + j < size; ++j)
+    b |= static_cast<uint64_t>(data[i + j]) << (8 * j);
+
+  v3 ^= b;
+  sip_round(v0, v1, v2, v3);
+  sip_round(v0, v1, v2, v3);
+  v0 ^= b;
+  v2 ^= 0xff;
+  for (int r = 0; r < 4; ++r)
+    sip_round(v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// Сравнение за время, не зависящее от того, в каком символе строки различаются,
+//  чтобы по времени ответа нельзя было подбирать токен посимвольно
+bool equal_tokens(const std::string & a, const std::string & b)
+{
+  if (a.size() != b.size())
+    return false;
+  unsigned char diff = 0;
+  for (size_t i = 0; i < a.size(); ++i)
+    diff |= static_cast<unsigned char>(a[i] ^ b[i]);
+  return diff == 0;
+}
+
+// Выбирает из адреса только значимые байты: IP-адрес и порт
+// Остальные поля sockaddr(например, sin_zero) не должны влиять на токен
+size_t address_key(const net_address & addr, uint8_t * out)
+{
+  switch (addr.family())
+  {
+  case AF_INET:
+  {
+    const auto * in = reinterpret_cast<const sockaddr_in *>(addr.data());
+    ::memcpy(out, &in->sin_addr, 4);
+    ::memcpy(out + 4, &in->sin_port, 2);
+    return 6;
+  }
+  case AF_INET6:
+  {
+    const auto * in6 = reinterpret_cast<const sockaddr_in6 *>(addr.data());
+    ::memcpy(out, &in6->sin6_addr, 16);
+    ::memcpy(out + 16, &in6->sin6_port, 2);
+    return 18;
+  }
+  default:
+    return 0;
+  }
+}
+
+}
+
+udp_service::udp_service() :
+  sock(INVALID_SOCKET),
+  decoder(*this),
+  batch(batch_size),
+  current(nullptr),
+  started(std::chrono::steady_clock::now())
+{
+  std::random_device rd;
+  for (auto & part : secret)
+    part = (static_cast<uint64_t>(rd()) << 32) | rd();
+
+  for (auto & dgram : batch)
+    dgram.data.resize(max_datagram_size);
+}
+
+udp_service::~udp_service()
+{
+  close();
+}
+
+bool udp_service::open(const net_address & addr)
+{
+  if (addr.family() != AF_INET && addr.family() != AF_INET6)
+  {
+    std::cerr << "udp service supports only IPv4 and IPv6: " << addr.to_string() << std::endl;
+    return false;
+  }
+
+  SOCKET s = ::socket(addr.family(), SOCK_DGRAM, IPPROTO_UDP);
+  if (s == INVALID_SOCKET)
+  {
+    std::cerr << "udp socket: " << last_network_error_message() << std::endl;
+    return false;
+  }
+
+  if (addr.family() == AF_INET6)
+  {
+    int on = 1;
+    ::setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char *>(&on), sizeof(on));
+  }
+
+  u_long val = 1;
+#ifdef WIN32
+  if (::ioctlsocket(s, FIONBIO, &val) == SOCKET_ERROR ||
+#else
+  if (::ioctl(s, FIONBIO, &val) == SOCKET_ERROR ||
+#endif
+      ::bind(s, addr.data(), addr.size()) == SOCKET_ERROR)
+  {
+    std::cerr << "udp bind " << addr.to_string() << ": " << last_network_error_message() << std::endl;
+    ::closesocket(s);
+    return false;
+  }
+
+  sock = s;
+  address = addr;
+  if (log_enabled(log_level::info))
+    std::cout << "udp listen on: " << address.to_string() << std::endl;
+  return true;
+}
+
+void udp_service::close()
+{
+  if (sock == INVALID_SOCKET)
+    return;
+  ::closesocket(sock);
+  sock = INVALID_SOCKET;
+}
+
+void udp_service::on_socket_readable(SOCKET)
+{
+  // Обрабатываем одну пачку за пробуждение, чтобы не задерживать TCP-клиентов
+  // Если датаграммы ещё остались, select сразу же разбудит нас снова
+  size_t count = receive_batch();
+  if (count == 0)
+    return;
+
+  for (size_t i = 0; i < count; ++i)
+    process(batch[i]);
+
+  send_batch(count);
+}
+
+#ifdef __linux__
+
+size_t udp_service::receive_batch()
+{
+  mmsghdr msgs[batch_size];
+  iovec iovs[batch_size];
+  ::memset(msgs, 0, sizeof(msgs));
+
+  for (size_t i = 0; i < batch_size; ++i)
+  {
+    iovs[i].iov_base = batch[i].data.data();
+    iovs[i].iov_len = batch[i].data.size();
+    msgs[i].msg_hdr.msg_name = batch[i].peer.data();
+    msgs[i].msg_hdr.msg_namelen = net_address::capacity();
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  int res = ::recvmmsg(sock, msgs, batch_size, MSG_DONTWAIT, nullptr);
+  if (res < 0)
+  {
+    int err = net_error();
+    if (err != NetWouldBlock && err != NetAgain)
+      std::cerr << "recvmmsg: " << last_network_error_message() << std::endl;
+    return 0;
+  }
+
+  for (int i = 0; i < res; ++i)
+  {
+    batch[i].peer.set_size(msgs[i].msg_hdr.msg_namelen);
+    batch[i].size = msgs[i].msg_len;
+    batch[i].truncated = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+  }
+  stats.received += res;
+  return res;
+}
+
+void udp_service::send_batch(size_t count)
+{
+  mmsghdr msgs[batch_size];
+  iovec iovs[batch_size];
+  ::memset(msgs, 0, sizeof(msgs));
+
+  // Собираем только те датаграммы, на которые есть ответ
+  size_t to_send = 0;
+  for (size_t i = 0; i < count; ++i)
+  {
+    datagram & dgram = batch[i];
+    if (dgram.reply.empty())
+      continue;
+    iovs[to_send].iov_base = dgram.reply.data();
+    iovs[to_send].iov_len = dgram.reply.size();
+    msgs[to_send].msg_hdr.msg_name = dgram.peer.data();
+    msgs[to_send].msg_hdr.msg_namelen = dgram.peer.size();
+    msgs[to_send].msg_hdr.msg_iov = &iovs[to_send];
+    msgs[to_send].msg_hdr.msg_iovlen = 1;
+    ++to_send;
+  }
+
+  // sendmmsg может отправить только часть пачки, тогда досылаем остаток
+  // Если буфер сокета переполнен, то оставшиеся ответы теряются, как и положено UDP
+  size_t sent = 0;
+  while (sent < to_send)
+  {
+    int res = ::sendmmsg(sock, msgs + sent, to_send - sent, MSG_DONTWAIT);
+    if (res <= 0)
+    {
+      int err = net_error();
+      if (err != NetWouldBlock && err != NetAgain)
+        std::cerr << "sendmmsg: " << last_network_error_message() << std::endl;
+      break;
+    }
+    sent += res;
+  }
+  stats.sent += sent;
+  stats.dropped += to_send - sent;
+}
+
+#else
+
+// На остальных платформах нет пакетных вызовов, поэтому принимаем и посылаем по одной датаграмме
+size_t udp_service::receive_batch()
+{
+  size_t count = 0;
+  for (; count < batch_size; ++count)
+  {
+    datagram & dgram = batch[count];
+    socklen_t addr_len = net_address::capacity();
+    int res = ::recvfrom(sock, reinterpret_cast<char *>(dgram.data.data()), dgram.data.size(), 0,
+                         dgram.peer.data(), &addr_len);
+    if (res < 0)
+      break;
+    dgram.peer.set_size(addr_len);
+    dgram.size = res;
+    dgram.truncated = false;
+  }
+  stats.received += count;
+  return count;
+}
+
+void udp_service::send_batch(size_t count)
+{
+  for (size_t i = 0; i < count; ++i)
+  {
+    datagram & dgram = batch[i];
+    if (dgram.reply.empty())
+      continue;
+    int res = ::sendto(sock, reinterpret_cast<const char *>(dgram.reply.data()), dgram.reply.size(), 0,
+                       dgram.peer.data(), dgram.peer.size());
+    if (res < 0)
+      ++stats.dropped;
+    else
+      ++stats.sent;
+  }
+}
+
+#endif
+
+void udp_service::process(datagram & dgram)
+{
+  dgram.reply.clear();
+  current = &dgram;
+
+  if (dgram.truncated)
+  {
+    on_decode_error();
+  }
+  else
+  {
+    decoder.add_data_and_try_decode(dgram.data.data(), dgram.size);
+    // Датаграмма сама по себе является границей команды, поэтому перевод строки необязателен
+    if (dgram.size == 0 || dgram.data[dgram.size - 1] != '\n')
+    {
+      const uint8_t eol = '\n';
+      decoder.add_data_and_try_decode(&eol, 1);
+    }
+  }
+
+  current = nullptr;
+  if (dgram.reply.size() > dgram.size)
+  {
+    ++stats.too_short;
+    dgram.reply.clear();
+  }
+}
+
+void udp_service::on_decoded_command(command cmd)
+{
+  // Отвечаем только на первую команду датаграммы
+  if (current == nullptr || current->reply.empty() == false)
+    return;
+
+  command to_send;
+  uint64_t epoch = current_epoch();
+  if (cmd.type == "hello")
+  {
+    to_send.type = "ok";
+    to_send.args.emplace("token", make_token(current->peer, epoch));
+    reply(std::move(to_send));
+    return;
+  }
+
+  // Без правильного токена отвечаем ошибкой на любую команду
+  // Подходит токен текущей и предыдущей эпохи, проверяем оба, чтобы время проверки не зависело от эпохи
+  auto token = cmd.args.find("token");
+  bool valid = false;
+  if (token != cmd.args.end())
+    valid = equal_tokens(token->second, make_token(current->peer, epoch)) |
+            (epoch != 0 && equal_tokens(token->second, make_token(current->peer, epoch - 1)));
+  if (valid == false)
+  {
+    ++stats.bad_token;
+    to_send.type = "error";
+  }
+  else if (cmd.type == "roll")
+  {
+    to_send.type = "won";
+    to_send.args.emplace("result", std::to_string(roll_dice()));
+  }
+  else
+  {
+    to_send.type = "error";
+  }
+  reply(std::move(to_send));
+}
+
+void udp_service::on_decode_error()
+{
+  if (current == nullptr || current->reply.empty() == false)
+    return;
+  command to_send;
+  to_send.type = "error";
+  reply(std::move(to_send));
+}
+
+void udp_service::reply(command cmd)
+{
+  if (current == nullptr)
+    return;
+  command_encoder::encode(cmd, current->reply);
+}
+
+uint64_t udp_service::current_epoch() const
+{
+  auto elapsed = std::chrono::steady_clock::now() - started;
+  return static_cast<uint64_t>(elapsed / token_epoch);
+}
+
+// Токен - SipHash адреса клиента и номера эпохи в шестнадцатеричном виде
+std::string udp_service::make_token(const net_address & peer, uint64_t epoch) const
+{
+  uint8_t key[32];
+  size_t key_size = address_key(peer, key);
+  for (int i = 0; i < 8; ++i)
+    key[key_size++] = static_cast<uint8_t>(epoch >> (8 * i));
+  uint64_t hash = siphash(secret, key, key_size);
+
+  static constexpr char digits[] = "0123456789abcdef";
+  std::string ret(16, '0');
+  for (int i = 15; i >= 0; --i, hash >>= 4)
+    ret[i] = digits[hash & 0xF];
+  return ret;
+}
@@ -0,0 +1,96 @@
+#ifndef UDP_SERVICE_H
+#define UDP_SERVICE_H
+
+#include "connection_manager.h"
+#include "command_decoder.h"
+#include "net_address.h"
+#include <chrono>
+#include <vector>
+
+// Сервис бросков костей без установки соединения, работающий поверх UDP
+// Одна датаграмма - одна команда, остальные команды из той же датаграммы отбрасываются
+// Кодирование команд такое же, как у TCP: используются command_decoder и command_encoder
+//
+// Т.к. сервис не хранит состояний клиентов, вместо флага got_handshake используется токен:
+//  - на "hello\n" сервер отвечает "ok:token=XXXXXXXXXXXXXXXX;\n",
+//  - токен является подписью адреса клиента и номера эпохи секретным ключом сервера,
+//  - к каждой следующей команде клиент добавляет этот токен: "roll:token=XXXXXXXXXXXXXXXX\n".
+// Таким образом, клиент с чужого адреса не может бросать кости, а сервер ничего не запоминает
+// Токен действует текущую и следующую эпоху(token_epoch), потом нужно снова прислать hello,
+//  ключ генерируется при каждом запуске, поэтому после перезапуска тоже
+//
+// Адрес отправителя UDP легко подделать, поэтому ответ никогда не бывает длиннее запроса:
+//  иначе сервис можно использовать для усиления атаки на чужой адрес
+// Если ответ длиннее, он не отправляется, так что hello нужно дополнить до длины ответа,
+//  например "hello:pad=XXXXXXXXXXXXXXXX\n"
+//
+// На Linux датаграммы принимаются и отправляются пачками через recvmmsg/sendmmsg
+class udp_service : public socket_watcher,
+                    public command_decoder_user
+{
+public:
+  // Максимальное количество датаграмм, обрабатываемых за один системный вызов
+  static constexpr size_t batch_size = 64;
+  // Максимальный размер датаграммы, всё что длиннее считается ошибкой
+  static constexpr size_t max_datagram_size = 2048;
+  // Длительность эпохи токенов
+  static constexpr std::chrono::seconds token_epoch{300};
+
+  udp_service();
+  ~udp_service() override;
+
+  // Открывает сокет на переданном адресе, сокет неблокирующий
+  [[nodiscard]]
+  bool open(const net_address & address);
+  void close();
+  SOCKET socket() const { return sock; }
+
+  // Счётчики для статистики
+  struct counters
+  {
+    uint64_t received = 0;
+    uint64_t sent = 0;
+    uint64_t dropped = 0;
+    uint64_t bad_token = 0;
+    // Ответы, не отправленные из-за того, что они длиннее запроса
+    uint64_t too_short = 0;
+  };
+  const counters & get_counters() const { return stats; }
+
+  // socket_watcher interface
+  void on_socket_readable(SOCKET sock) override;
+
+  // command_decoder_user interface
+  void on_decoded_command(command cmd) override;
+  void on_decode_error() override;
+
+private:
+  // Ячейка пачки: принятая датаграмма, адрес отправителя и ответ
+  struct datagram
+  {
+    net_address peer;
+    buffer_type data;
+    size_t size = 0;
+    bool truncated = false;
+    buffer_type reply;
+  };
+
+  SOCKET sock;
+  net_address address;
+  command_decoder decoder;
+  std::vector<datagram> batch;
+  // Датаграмма, которая сейчас декодируется
+  datagram * current;
+  uint64_t secret[2];
+  std::chrono::steady_clock::time_point started;
+  counters stats;
+
+  size_t receive_batch();
+  void send_batch(size_t count);
+  void process(datagram & dgram);
+  void reply(command cmd);
+  uint64_t current_epoch() const;
+  std::string make_token(const net_address & peer, uint64_t epoch) const;
+};
+
+#endif // UDP_SERVICE_H
@@ -0,0 +1,350 @@
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include "net_address.h"
+#ifdef ROLL_ENABLE_TLS
+#include <openssl/ssl.h>
+#endif
+
+// Генератор нагрузки для замеров задержек сервера
+// Открывает несколько соединений, делает hello и дальше в замкнутом цикле шлёт roll:
+//  как только приходит ответ, сразу посылается следующая команда
+// В конце печатает пропускную способность и перцентили задержек
+// Пример: roll_load --target=127.0.0.1:35555 --connections=4 --duration=10
+// С --tls соединения шифруются, сертификат сервера не проверяется
+
+namespace
+{
+
+using load_clock = std::chrono::steady_clock;
+
+struct options
+{
+  net_address target;
+  int connections = 1;
+  int pipeline = 1;
+  int duration_sec = 5;
+  int warmup_sec = 1;
+  // Клиент тоже может опрашивать сокеты без сна, чтобы не добавлять свои пробуждения к задержке
+  bool spin = false;
+  bool tls = false;
+};
+
+#ifdef ROLL_ENABLE_TLS
+SSL_CTX * tls_ctx = nullptr;
+#endif
+
+struct client
+{
+  SOCKET sock = INVALID_SOCKET;
+#ifdef ROLL_ENABLE_TLS
+  SSL * ssl = nullptr;
+#endif
+  // Время отправки команд, ответы на которые ещё не пришли
+  std::deque<load_clock::time_point> in_flight;
+  std::string pending;
+};
+
+struct stats
+{
+  std::vector<uint64_t> latencies_ns;
+  uint64_t responses = 0;
+  uint64_t errors = 0;
+};
+
+#ifdef ROLL_ENABLE_TLS
+// Приводит результат SSL_read/SSL_write к виду recv/send: "повторить позже" - это -1 и EAGAIN
+ssize_t tls_result(SSL * ssl, int res)
+{
+  if (res > 0)
+    return res;
+  int err = SSL_get_error(ssl, res);
+  if (err == SSL_ERROR_ZERO_RETURN)
+    return 0;
+  errno = err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? EAGAIN : EIO;
+  return -1;
+}
+#endif
+
+ssize_t client_send(client & cl, const char * data, size_t size)
+{
+#ifdef ROLL_ENABLE_TLS
+  if (cl.ssl != nullptr)
+    return tls_result(cl.ssl, SSL_write(cl.ssl, data, static_cast<int>(size)));
+#endif
+  return ::send(cl.sock, data, size, 0);
+}
+
+ssize_t client_recv(client & cl, char * buf, size_t size)
+{
+#ifdef ROLL_ENABLE_TLS
+  if (cl.ssl != nullptr)
+    return tls_result(cl.ssl, SSL_read(cl.ssl, buf, static_cast<int>(size)));
+#endif
+  return ::recv(cl.sock, buf, size, 0);
+}
+
+bool send_all(client & cl, const char * data, size_t size)
+{
+  while (size != 0)
+  {
+    ssize_t n = client_send(cl, data, size);
+    if (n < 0)
+    {
+      if (net_error() == NetWouldBlock || net_error() == NetAgain)
+      {
+        pollfd pfd{cl.sock, POLLOUT, 0};
+        ::poll(&pfd, 1, 100);
+        continue;
+      }
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool send_roll(client & cl)
+{
+  static const char roll[] = "roll\n";
+  cl.in_flight.push_back(load_clock::now());
+  return send_all(cl, roll, sizeof(roll) - 1);
+}
+
+// Подключается, при --tls проходит рукопожатие TLS и делает hello в блокирующем режиме
+bool connect_client(const options & opts, client & cl)
+{
+  cl.sock = ::socket(opts.target.family(), SOCK_STREAM, 0);
+  if (cl.sock == INVALID_SOCKET ||
+      ::connect(cl.sock, opts.target.data(), opts.target.size()) == SOCKET_ERROR)
+  {
+    std::cerr << "connect to " << opts.target.to_string() << ": " << last_network_error_message() << std::endl;
+    return false;
+  }
+
+  int on = 1;
+  if (opts.target.family() != AF_UNIX)
+    ::setsockopt(cl.sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+#ifdef ROLL_ENABLE_TLS
+  if (opts.tls)
+  {
+    cl.ssl = SSL_new(tls_ctx);
+    if (cl.ssl == nullptr || SSL_set_fd(cl.ssl, cl.sock) != 1 || SSL_connect(cl.ssl) != 1)
+    {
+      std::cerr << "tls handshake with " << opts.target.to_string() << " failed" << std::endl;
+      return false;
+    }
+  }
+#endif
+
+  char buf[64];
+  if (send_all(cl, "hello\n", 6) == false || client_recv(cl, buf, sizeof(buf)) <= 0 ||
+      ::strncmp(buf, "ok\n", 3) != 0)
+  {
+    std::cerr << "handshake failed" << std::endl;
+    return false;
+  }
+
+  u_long val = 1;
+  ::ioctl(cl.sock, FIONBIO, &val);
+  return true;
+}
+
+// Разбирает ответы, на каждый ответ сразу посылает следующую команду
+bool handle_readable(client & cl, stats & st, bool measure)
+{
+  char buf[4096];
+  for (;;)
+  {
+    ssize_t n = client_recv(cl, buf, sizeof(buf));
+    if (n < 0 && (net_error() == NetWouldBlock || net_error() == NetAgain))
+      break;
+    if (n <= 0)
+    {
+      std::cerr << "server closed connection" << std::endl;
+      return false;
+    }
+    cl.pending.append(buf, n);
+  }
+
+  auto now = load_clock::now();
+  size_t pos = 0;
+  size_t eol = cl.pending.find('\n');
+  while (eol != std::string::npos)
+  {
+    if (cl.in_flight.empty() == false)
+    {
+      if (measure)
+      {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - cl.in_flight.front()).count();
+        st.latencies_ns.push_back(ns);
+        ++st.responses;
+        if (cl.pending.compare(pos, 3, "won") != 0)
+          ++st.errors;
+      }
+      cl.in_flight.pop_front();
+    }
+    if (send_roll(cl) == false)
+      return false;
+    pos = eol + 1;
+    eol = cl.pending.find('\n', pos);
+  }
+  cl.pending.erase(0, pos);
+  return true;
+}
+
+uint64_t percentile(const std::vector<uint64_t> & sorted, double p)
+{
+  if (sorted.empty())
+    return 0;
+  size_t idx = static_cast<size_t>(p / 100.0 * (sorted.size() - 1));
+  return sorted[idx];
+}
+
+void print_stats(stats & st, double seconds)
+{
+  std::sort(st.latencies_ns.begin(), st.latencies_ns.end());
+  auto us = [](uint64_t ns) { return ns / 1000.0; };
+  std::cout << "responses: " << st.responses << std::endl
+            << "errors: " << st.errors << std::endl
+            << "throughput: " << st.responses / seconds << " req/s" << std::endl
+            << "latency us: p50=" << us(percentile(st.latencies_ns, 50))
+            << " p90=" << us(percentile(st.latencies_ns, 90))
+            << " p99=" << us(percentile(st.latencies_ns, 99))
+            << " p99.9=" << us(percentile(st.latencies_ns, 99.9))
+            << " max=" << us(st.latencies_ns.empty() ? 0 : st.latencies_ns.back()) << std::endl;
+}
+
+void print_usage(const char * name)
+{
+  std::cerr << "Usage: " << name << " [options]" << std::endl
+            << "Options:" << std::endl
+            << "  --target=ADDR      server address, default 127.0.0.1:35555" << std::endl
+            << "  --connections=N    number of connections, default 1" << std::endl
+            << "  --pipeline=N       commands in flight per connection, default 1" << std::endl
+            << "  --duration=SEC     measurement time, default 5" << std::endl
+            << "  --warmup=SEC       time before measurement, default 1" << std::endl
+            << "  --spin             poll without sleeping on the client side" << std::endl
+            << "  --tls              connect to a TLS listener" << std::endl;
+}
+
+bool parse_options(int argc, char ** argv, options & opts)
+{
+  if (net_address::parse("127.0.0.1:35555", opts.target) == false)
+    return false;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    if (arg.compare(0, 9, "--target=") == 0)
+    {
+      if (net_address::parse(arg.substr(9), opts.target) == false)
+        return false;
+    }
+    else if (arg.compare(0, 14, "--connections=") == 0)
+      opts.connections = std::stoi(arg.substr(14));
+    else if (arg.compare(0, 11, "--pipeline=") == 0)
+      opts.pipeline = std::stoi(arg.substr(11));
+    else if (arg.compare(0, 11, "--duration=") == 0)
+      opts.duration_sec = std::stoi(arg.substr(11));
+    else if (arg.compare(0, 9, "--warmup=") == 0)
+      opts.warmup_sec = std::stoi(arg.substr(9));
+    else if (arg == "--spin")
+      opts.spin = true;
+    else if (arg == "--tls")
+      opts.tls = true;
+    else
+      return false;
+  }
+  return opts.connections > 0 && opts.pipeline > 0 && opts.duration_sec > 0;
+}
+
+bool init_tls(const options & opts)
+{
+  if (opts.tls == false)
+    return true;
+#ifdef ROLL_ENABLE_TLS
+  tls_ctx = SSL_CTX_new(TLS_client_method());
+  if (tls_ctx == nullptr)
+    return false;
+#ifdef SSL_OP_ENABLE_KTLS
+  // Клиент тоже может отдать шифрование ядру, чтобы не мерить свою же криптографию
+  SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+  return true;
+#else
+  std::cerr << "built without TLS support" << std::endl;
+  return false;
+#endif
+}
+
+}
+
+int main(int argc, char ** argv)
+{
+  options opts;
+  if (parse_options(argc, argv, opts) == false)
+  {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (init_tls(opts) == false)
+    return EXIT_FAILURE;
+
+  std::vector<client> clients(opts.connections);
+  std::vector<pollfd> fds(opts.connections);
+  for (int i = 0; i < opts.connections; ++i)
+  {
+    if (connect_client(opts, clients[i]) == false)
+      return EXIT_FAILURE;
+    fds[i] = pollfd{clients[i].sock, POLLIN, 0};
+  }
+
+  stats st;
+  st.latencies_ns.reserve(1 << 20);
+
+  for (auto & cl : clients)
+  {
+    for (int i = 0; i < opts.pipeline; ++i)
+      send_roll(cl);
+  }
+
+  auto started = load_clock::now();
+  auto measure_from = started + std::chrono::seconds(opts.warmup_sec);
+  auto finish = measure_from + std::chrono::seconds(opts.duration_sec);
+  for (auto now = started; now < finish; now = load_clock::now())
+  {
+    int res = ::poll(fds.data(), fds.size(), opts.spin ? 0 : 100);
+    if (res < 0 && net_error() != NetInterrupted)
+    {
+      std::cerr << "poll: " << last_network_error_message() << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    bool measure = now >= measure_from;
+    for (size_t i = 0; i < fds.size() && res > 0; ++i)
+    {
+      if (fds[i].revents == 0)
+        continue;
+      if (handle_readable(clients[i], st, measure) == false)
+        return EXIT_FAILURE;
+    }
+  }
+
+  for (auto & cl : clients)
+  {
+#ifdef ROLL_ENABLE_TLS
+    SSL_free(cl.ssl);
+#endif
+    ::closesocket(cl.sock);
+  }
+
+  print_stats(st, opts.duration_sec);
+  return EXIT_SUCCESS;
+}